@@ -1,13 +1,20 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
 //
+// Each hash bucket has its own lock, so lookups of blocks in
+// different buckets proceed in parallel. Recycling a buffer
+// picks the least recently released unused buffer by its
+// timestamp, and is serialized by bcache.lock.
+//
 // Interface:
 // * To get a buffer for a particular disk block, call bread.
 // * After changing buffer data, call bwrite to write it to disk.
+// * breadv and bwritev do the same for a batch of buffers,
+//     keeping all of the batch's disk requests in flight at once.
 // * When done with the buffer, call brelse.
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
@@ -23,69 +30,152 @@
 #include "fs.h"
 #include "buf.h"
 
-struct {
+#define NBUCKET 13  // prime, so block numbers spread evenly
+#define BHASH(dev, blockno) (((dev) * 31 + (blockno)) % NBUCKET)
+
+struct bucket {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct buf *head;   // chain through buf.next
+  uint64 nacquire;    // times lock was acquired
+  uint64 ncontend;    // ... and found already held
+  uint64 nhit;        // lookups satisfied from this bucket
+};
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  struct buf head;
+struct {
+  struct spinlock lock;  // serializes recycling buffers
+  struct buf buf[NBUF];
+  struct bucket bucket[NBUCKET];
+  uint64 nmiss;
 } bcache;
 
+// Acquire a bucket's lock, counting contention.
+// The peek at lk.locked is racy, so the count is
+// only approximate, but it costs no extra atomics.
+static void
+lockbucket(struct bucket *bk)
+{
+  int busy = __atomic_load_n(&bk->lock.locked, __ATOMIC_RELAXED);
+
+  acquire(&bk->lock);
+  bk->nacquire++;
+  if(busy)
+    bk->ncontend++;
+}
+
 void
 binit(void)
 {
   struct buf *b;
 
   initlock(&bcache.lock, "bcache");
+  for(int i = 0; i < NBUCKET; i++)
+    initlock(&bcache.bucket[i].lock, "bcache.bucket");
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
+  // All buffers start out unused, in bucket 0.
   for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
     initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    b->next = bcache.bucket[0].head;
+    bcache.bucket[0].head = b;
   }
 }
 
-// Look through buffer cache for block on device dev.
-// If not found, allocate a buffer.
-// In either case, return locked buffer.
+// Look for block on device dev in bucket bk, whose lock
+// the caller holds. If found, take a reference to it.
 static struct buf*
-bget(uint dev, uint blockno)
+bfind(struct bucket *bk, uint dev, uint blockno)
 {
   struct buf *b;
 
-  acquire(&bcache.lock);
-
-  // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
+  for(b = bk->head; b != 0; b = b->next){
     if(b->dev == dev && b->blockno == blockno){
       b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
+      bk->nhit++;
       return b;
     }
   }
+  return 0;
+}
+
+// Look through buffer cache for block on device dev.
+// If not found, allocate a buffer.
+// In either case, return locked buffer.
+static struct buf*
+bget(uint dev, uint blockno)
+{
+  struct bucket *bk, *vbk;
+  struct buf *b, *victim, **pp;
+  int i;
+
+  bk = &bcache.bucket[BHASH(dev, blockno)];
+  lockbucket(bk);
+  b = bfind(bk, dev, blockno);
+  release(&bk->lock);
+  if(b){
+    acquiresleep(&b->lock);
+    return b;
+  }
+
+  // Not cached. Only one CPU recycles at a time, so
+  // the block can't be inserted behind our back once
+  // we hold bcache.lock; check again first, since it
+  // may have been inserted before we got here.
+  acquire(&bcache.lock);
+  lockbucket(bk);
+  b = bfind(bk, dev, blockno);
+  release(&bk->lock);
+  if(b){
+    release(&bcache.lock);
+    acquiresleep(&b->lock);
+    return b;
+  }
+  bcache.nmiss++;
 
-  // Not cached.
   // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+  // Keep the lock of the bucket holding the best candidate
+  // so far. Buckets are locked in index order, so this
+  // cannot deadlock with another scan.
+  victim = 0;
+  vbk = 0;
+  for(i = 0; i < NBUCKET; i++){
+    struct bucket *cur = &bcache.bucket[i];
+    int found = 0;
+
+    lockbucket(cur);
+    for(b = cur->head; b != 0; b = b->next){
+      if(b->refcnt == 0 && (victim == 0 || b->lastuse < victim->lastuse)){
+        victim = b;
+        found = 1;
+      }
+    }
+    if(found){
+      if(vbk)
+        release(&vbk->lock);
+      vbk = cur;
+    } else {
+      release(&cur->lock);
     }
   }
-  panic("bget: no buffers");
+  if(victim == 0)
+    panic("bget: no buffers");
+
+  // Unlink the victim from its old bucket.
+  for(pp = &vbk->head; *pp != victim; pp = &(*pp)->next)
+    ;
+  *pp = victim->next;
+  victim->dev = dev;
+  victim->blockno = blockno;
+  victim->valid = 0;
+  victim->refcnt = 1;
+  release(&vbk->lock);
+
+  lockbucket(bk);
+  victim->next = bk->head;
+  bk->head = victim;
+  release(&bk->lock);
+  release(&bcache.lock);
+
+  acquiresleep(&victim->lock);
+  return victim;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -111,43 +201,100 @@ bwrite(struct buf *b)
   virtio_disk_rw(b, 1);
 }
 
+// Return locked bufs in bp[] for the n blocks of dev listed in
+// blocknos[], which must be distinct. All of the blocks that
+// aren't cached are read with their requests in flight at once.
+void
+breadv(uint dev, uint *blocknos, struct buf **bp, int n)
+{
+  int i;
+
+  for(i = 0; i < n; i++){
+    bp[i] = bget(dev, blocknos[i]);
+    if(!bp[i]->valid)
+      virtio_disk_submit(bp[i], 0);
+  }
+  virtio_disk_kick();
+  for(i = 0; i < n; i++){
+    if(!bp[i]->valid){
+      virtio_disk_wait(bp[i]);
+      bp[i]->valid = 1;
+    }
+  }
+}
+
+// Write the contents of n locked bufs to disk, with all of
+// the requests in flight at once.
+void
+bwritev(struct buf **bp, int n)
+{
+  int i;
+
+  for(i = 0; i < n; i++){
+    if(!holdingsleep(&bp[i]->lock))
+      panic("bwritev");
+    virtio_disk_submit(bp[i], 1);
+  }
+  virtio_disk_kick();
+  for(i = 0; i < n; i++)
+    virtio_disk_wait(bp[i]);
+}
+
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
+// Record when it was last used, for recycling.
 void
 brelse(struct buf *b)
 {
+  struct bucket *bk;
+
   if(!holdingsleep(&b->lock))
     panic("brelse");
 
   releasesleep(&b->lock);
 
-  acquire(&bcache.lock);
+  bk = &bcache.bucket[BHASH(b->dev, b->blockno)];
+  lockbucket(bk);
   b->refcnt--;
   if (b->refcnt == 0) {
     // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    b->lastuse = ticks;
   }
-  
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = &bcache.bucket[BHASH(b->dev, b->blockno)];
+
+  lockbucket(bk);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = &bcache.bucket[BHASH(b->dev, b->blockno)];
+
+  lockbucket(bk);
   b->refcnt--;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
+// Report buffer cache counters for the statistics device.
+int
+bcachestats(char *buf, int sz)
+{
+  struct bucket *bk;
+  uint64 nhit = 0;
+  int n;
 
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++)
+    nhit += bk->nhit;
+  n = snprintf(buf, sz, "bcache: hit %ld miss %ld\n", nhit, bcache.nmiss);
+  for(int i = 0; i < NBUCKET; i++){
+    bk = &bcache.bucket[i];
+    n += snprintf(buf+n, sz-n, "bcache: bucket %d acquire %ld contend %ld\n",
+                  i, bk->nacquire, bk->ncontend);
+  }
+  return n;
+}
@@ -5,8 +5,8 @@ struct buf {
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
-  struct buf *next;
+  uint lastuse;     // ticks when last released, for LRU
+  struct buf *next; // hash bucket chain
   uchar data[BSIZE];
 };
 
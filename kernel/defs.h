@@ -14,8 +14,11 @@ void            binit(void);
 struct buf*     bread(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            breadv(uint, uint*, struct buf**, int);
+void            bwritev(struct buf**, int);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
+int             bcachestats(char*, int);
 
 // console.c
 void            consoleinit(void);
@@ -30,9 +33,9 @@ struct file*    filealloc(void);
 void            fileclose(struct file*);
 struct file*    filedup(struct file*);
 void            fileinit(void);
-int             fileread(struct file*, uint64, int n);
+int             fileread(struct file*, int, uint64, int n);
 int             filestat(struct file*, uint64 addr);
-int             filewrite(struct file*, uint64, int n);
+int             filewrite(struct file*, int, uint64, int n);
 
 // fs.c
 void            fsinit(int);
@@ -50,9 +53,13 @@ int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, int, uint64, uint, uint);
+int             readblocks(struct inode*, int, uint64, uint, uint);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, int, uint64, uint, uint);
 void            itrunc(struct inode*);
+void            dcacheremove(struct inode*, char*);
+int             dcachestats(char*, int);
+int             itablestats(char*, int);
 
 // ramdisk.c
 void            ramdiskinit(void);
@@ -62,44 +69,90 @@ void            ramdiskrw(struct buf*);
 // kalloc.c
 void*           kalloc(void);
 void            kfree(void *);
+void*           kalloc_pages(int);
+void            kfree_pages(void *, int);
+void            kdup(void *);
+int             kdrop(void *);
+int             krefcnt(void *);
 void            kinit(void);
+uint64          kfreepages(void);
+int             kallocstats(char*, int);
 
 // log.c
 void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
 void            begin_op(void);
 void            end_op(void);
+int             logstats(char*, int);
 
 // pipe.c
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, uint64, int);
 int             pipewrite(struct pipe*, uint64, int);
+int             pipefcntl(struct pipe*, int, int);
+int             pipesplicein(struct pipe*, struct file*, int);
+int             pipespliceout(struct pipe*, struct file*, int);
+int             pipetee(struct pipe*, struct pipe*, int, int);
 
 // printf.c
 void            printf(char*, ...);
 void            panic(char*) __attribute__((noreturn));
 void            printfinit(void);
 
+// mmap.c
+struct vmtab*   vmtaballoc(void);
+struct vma*     vmalookup(struct vmtab*, uint64);
+int             vmaoverlap(struct proc*, uint64, uint64);
+uint64          mmapfault(pagetable_t, uint64, int);
+void            mmapprefault(uint64, uint64, int);
+uint64          mmap(uint64, int, int, struct file*, uint);
+int             munmap(uint64, uint64);
+int             mmapfork(struct proc*, struct proc*, int);
+void            munmapall(struct proc*);
+
+// pcache.c
+void            pcacheinit(void);
+char*           pcacheget(struct inode*, uint, int);
+int             pcacheread(struct inode*, int, uint64, uint, uint);
+void            pcachewrite(struct inode*, uint, char*, uint);
+void            pcacheinval(struct inode*, uint, uint);
+int             pcachereclaim(int);
+int             pcachestats(char*, int);
+
+// sprintf.c
+int             snprintf(char*, int, char*, ...);
+
+// stats.c
+void            statsinit(void);
+
 // proc.c
 int             cpuid(void);
 void            exit(int);
 int             fork(void);
 int             growproc(int);
+void            kthread(void (*)(void), char*);
 void            proc_mapstacks(pagetable_t);
 pagetable_t     proc_pagetable(struct proc *);
-void            proc_freepagetable(pagetable_t, uint64);
+void            proc_freepagetable(pagetable_t, uint64, uint64);
+int             clone(uint64, uint64, uint64);
+int             join(int);
 int             kill(int);
 struct cpu*     mycpu(void);
 struct cpu*     getmycpu(void);
 struct proc*    myproc();
 void            procinit(void);
 void            scheduler(void) __attribute__((noreturn));
+int             schedtick(void);
+int             setpriority(int, int);
+int             schedstats(char*, int);
 void            sched(void);
 void            sleep(void*, struct spinlock*);
 void            userinit(void);
 int             wait(uint64);
 void            wakeup(void*);
+int             wakeupn(void*, int);
+int             futex(uint64, int, int);
 void            yield(void);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
@@ -141,6 +194,7 @@ void            syscall();
 
 // trap.c
 extern uint     ticks;
+void            ipi(int);
 void            trapinit(void);
 void            trapinithart(void);
 extern struct spinlock tickslock;
@@ -163,10 +217,19 @@ void            uvminit(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
 int             uvmcopy(pagetable_t, pagetable_t, uint64);
+int             uvmcopyrange(pagetable_t, pagetable_t, uint64, uint64, int);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
+pte_t*          walk(pagetable_t, uint64, int);
 uint64          walkaddr(pagetable_t, uint64);
+int             cowfault(pagetable_t, uint64);
+uint64          vmfault(pagetable_t, uint64, uint64, int);
+void            tlbshootdown(pagetable_t);
+// vmfault() accesses
+#define VMREAD  0
+#define VMWRITE 1
+#define VMEXEC  2
 int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
@@ -180,6 +243,9 @@ void            plic_complete(int);
 // virtio_disk.c
 void            virtio_disk_init(void);
 void            virtio_disk_rw(struct buf *, int);
+void            virtio_disk_submit(struct buf *, int);
+void            virtio_disk_kick(void);
+void            virtio_disk_wait(struct buf *);
 void            virtio_disk_intr(void);
 
 // number of elements in fixed-size array
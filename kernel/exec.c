@@ -4,20 +4,43 @@
 #include "riscv.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
 #include "defs.h"
 #include "elf.h"
+#include "fcntl.h"
 
-static int loadseg(pde_t *pgdir, uint64 addr, struct inode *ip, uint offset, uint sz);
+// exec() does not read the program's segments. It records each
+// one as a MAP_PRIVATE vma of the program file, and vmfault()
+// reads the pages in as the program touches them, sharing
+// whole pages with other processes through the page cache.
+
+// PROT_ bits for a segment with ELF flags f.
+static int
+flags2prot(int f)
+{
+  int prot = 0;
+
+  if(f & ELF_PROG_FLAG_READ)
+    prot |= PROT_READ;
+  if(f & ELF_PROG_FLAG_WRITE)
+    prot |= PROT_WRITE;
+  if(f & ELF_PROG_FLAG_EXEC)
+    prot |= PROT_EXEC;
+  return prot;
+}
 
 int
 exec(char *path, char **argv)
 {
   char *s, *last;
-  int i, off;
+  int i, nseg, off;
   uint64 argc, sz = 0, sp, ustack[MAXARG], stackbase;
   struct elfhdr elf;
   struct inode *ip;
   struct proghdr ph;
+  struct vmtab *vt = 0;
   pagetable_t pagetable = 0, oldpagetable;
   struct proc *p = myproc();
 
@@ -37,8 +60,11 @@ exec(char *path, char **argv)
 
   if((pagetable = proc_pagetable(p)) == 0)
     goto bad;
+  if((vt = vmtaballoc()) == 0)
+    goto bad;
 
-  // Load program into memory.
+  // Record the program's segments, to be paged in on demand.
+  nseg = 0;
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, 0, (uint64)&ph, off, sizeof(ph)) != sizeof(ph))
       goto bad;
@@ -48,18 +74,24 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr + ph.memsz < ph.vaddr)
       goto bad;
-    uint64 sz1;
-    if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz)) == 0)
-      goto bad;
-    sz = sz1;
-    if((ph.vaddr % PGSIZE) != 0)
+    if(ph.vaddr + ph.memsz > USERTOP || ph.off + ph.filesz > ip->size)
       goto bad;
-    if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    if((ph.vaddr % PGSIZE) != 0 || nseg == NVMA)
       goto bad;
+    if(ph.vaddr < sz)
+      goto bad;  // segments must be in order and not overlap
+    vt->vma[nseg].start = ph.vaddr;
+    vt->vma[nseg].end = PGROUNDUP(ph.vaddr + ph.memsz);
+    vt->vma[nseg].prot = flags2prot(ph.flags);
+    vt->vma[nseg].flags = MAP_PRIVATE;
+    vt->vma[nseg].off = ph.off;
+    vt->vma[nseg].flen = ph.filesz;
+    nseg++;
+    sz = vt->vma[nseg-1].end;
   }
-  iunlockput(ip);
+  // keep a reference to ip for the segments.
+  iunlock(ip);
   end_op();
-  ip = 0;
 
   p = myproc();
   uint64 oldsz = p->sz;
@@ -69,7 +101,7 @@ exec(char *path, char **argv)
   sz = PGROUNDUP(sz);
   uint64 sz1;
   if((sz1 = uvmalloc(pagetable, sz, sz + 2*PGSIZE)) == 0)
-    goto bad;
+    goto badstack;
   sz = sz1;
   uvmclear(pagetable, sz-2*PGSIZE);
   sp = sz;
@@ -78,13 +110,13 @@ exec(char *path, char **argv)
   // Push argument strings, prepare rest of stack in ustack.
   for(argc = 0; argv[argc]; argc++) {
     if(argc >= MAXARG)
-      goto bad;
+      goto badstack;
     sp -= strlen(argv[argc]) + 1;
     sp -= sp % 16; // riscv sp must be 16-byte aligned
     if(sp < stackbase)
-      goto bad;
+      goto badstack;
     if(copyout(pagetable, sp, argv[argc], strlen(argv[argc]) + 1) < 0)
-      goto bad;
+      goto badstack;
     ustack[argc] = sp;
   }
   ustack[argc] = 0;
@@ -93,9 +125,9 @@ exec(char *path, char **argv)
   sp -= (argc+1) * sizeof(uint64);
   sp -= sp % 16;
   if(sp < stackbase)
-    goto bad;
+    goto badstack;
   if(copyout(pagetable, sp, (char *)ustack, (argc+1)*sizeof(uint64)) < 0)
-    goto bad;
+    goto badstack;
 
   // arguments to user main(argc, argv)
   // argc is returned via the system call return
@@ -109,46 +141,39 @@ exec(char *path, char **argv)
   safestrcpy(p->name, last, sizeof(p->name));
     
   // Commit to the user image.
+  munmapall(p);
+  for(i = 0; i < nseg; i++)
+    vt->vma[i].ip = idup(ip);
+  p->vmtab = vt;
+  begin_op();
+  iput(ip);
+  end_op();
   oldpagetable = p->pagetable;
   p->pagetable = pagetable;
   p->sz = sz;
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
-  proc_freepagetable(oldpagetable, oldsz);
+  proc_freepagetable(oldpagetable, oldsz, p->tfva);
+  p->tfva = TRAPFRAME;
 
   return argc; // this ends up in a0, the first argument to main(argc, argv)
 
  bad:
+  if(vt)
+    kfree((void*)vt);
   if(pagetable)
-    proc_freepagetable(pagetable, sz);
+    proc_freepagetable(pagetable, sz, TRAPFRAME);
   if(ip){
     iunlockput(ip);
     end_op();
   }
   return -1;
-}
 
-// Load a program segment into pagetable at virtual address va.
-// va must be page-aligned
-// and the pages from va to va+sz must already be mapped.
-// Returns 0 on success, -1 on failure.
-static int
-loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz)
-{
-  uint i, n;
-  uint64 pa;
-
-  for(i = 0; i < sz; i += PGSIZE){
-    pa = walkaddr(pagetable, va + i);
-    if(pa == 0)
-      panic("loadseg: address should exist");
-    if(sz - i < PGSIZE)
-      n = sz - i;
-    else
-      n = PGSIZE;
-    if(readi(ip, 0, (uint64)pa, offset+i, n) != n)
-      return -1;
-  }
-  
-  return 0;
+ badstack:
+  kfree((void*)vt);
+  proc_freepagetable(pagetable, sz, TRAPFRAME);
+  begin_op();
+  iput(ip);
+  end_op();
+  return -1;
 }
@@ -3,3 +3,17 @@
 #define O_RDWR    0x002
 #define O_CREATE  0x200
 #define O_TRUNC   0x400
+
+// fcntl() commands
+#define F_GETPIPE_SZ 1  // size of a pipe's buffer
+#define F_SETPIPE_SZ 2  // resize a pipe's buffer
+
+// mmap() protections
+#define PROT_NONE  0x0
+#define PROT_READ  0x1
+#define PROT_WRITE 0x2
+#define PROT_EXEC  0x4
+
+// mmap() flags
+#define MAP_SHARED  0x01  // stores reach the file
+#define MAP_PRIVATE 0x02  // stores stay in a private copy
@@ -102,24 +102,37 @@ filestat(struct file *f, uint64 addr)
 }
 
 // Read from file f.
-// addr is a user virtual address.
+// addr is a user virtual address if user_dst==1, or a kernel
+// address if user_dst==0, as splice() uses. Pipes only
+// take user addresses.
 int
-fileread(struct file *f, uint64 addr, int n)
+fileread(struct file *f, int user_dst, uint64 addr, int n)
 {
-  int r = 0;
+  int r = 0, m;
 
   if(f->readable == 0)
     return -1;
+  if(user_dst && n > 0){
+    // only the bytes the read can return; ip->size is a
+    // hint here, without the lock.
+    m = n;
+    if(f->type == FD_INODE && f->off + m > f->ip->size)
+      m = f->off < f->ip->size ? f->ip->size - f->off : 0;
+    mmapprefault(addr, m, VMREAD);
+  }
 
   if(f->type == FD_PIPE){
+    if(!user_dst)
+      return -1;
     r = piperead(f->pipe, addr, n);
   } else if(f->type == FD_DEVICE){
     if(f->major < 0 || f->major >= NDEV || !devsw[f->major].read)
       return -1;
-    r = devsw[f->major].read(1, addr, n);
+    if((r = devsw[f->major].read(user_dst, addr, n, f->off)) > 0)
+      f->off += r;
   } else if(f->type == FD_INODE){
     ilock(f->ip);
-    if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
+    if((r = readi(f->ip, user_dst, addr, f->off, n)) > 0)
       f->off += r;
     iunlock(f->ip);
   } else {
@@ -130,26 +143,34 @@ fileread(struct file *f, uint64 addr, int n)
 }
 
 // Write to file f.
-// addr is a user virtual address.
+// addr is a user virtual address if user_src==1, or a kernel
+// address if user_src==0. Pipes only take user addresses.
 int
-filewrite(struct file *f, uint64 addr, int n)
+filewrite(struct file *f, int user_src, uint64 addr, int n)
 {
   int r, ret = 0;
 
   if(f->writable == 0)
     return -1;
+  if(user_src && n > 0)
+    mmapprefault(addr, n, VMREAD);
 
   if(f->type == FD_PIPE){
+    if(!user_src)
+      return -1;
     ret = pipewrite(f->pipe, addr, n);
   } else if(f->type == FD_DEVICE){
     if(f->major < 0 || f->major >= NDEV || !devsw[f->major].write)
       return -1;
-    ret = devsw[f->major].write(1, addr, n);
+    ret = devsw[f->major].write(user_src, addr, n);
   } else if(f->type == FD_INODE){
     // write a few blocks at a time to avoid exceeding
     // the maximum log transaction size, including
     // i-node, indirect block, allocation blocks,
     // and 2 blocks of slop for non-aligned writes.
+    // (a write into the double-indirect range may log
+    // the double-indirect block and two indirect blocks
+    // instead, which also fits in MAXOPBLOCKS.)
     // this really belongs lower down, since writei()
     // might be writing a device like the console.
     int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
@@ -161,7 +182,7 @@ filewrite(struct file *f, uint64 addr, int n)
 
       begin_op();
       ilock(f->ip);
-      if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
+      if ((r = writei(f->ip, user_src, addr + i, f->off, n1)) > 0)
         f->off += r;
       iunlock(f->ip);
       end_op();
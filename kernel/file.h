@@ -18,6 +18,10 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  struct inode *next;     // itable hash chain
+  struct inode *lrunext;  // itable list of unreferenced inodes,
+  struct inode *lruprev;  //   least recently used first
+  int inlru;              // on that list?
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
 
@@ -26,15 +30,21 @@ struct inode {
   short minor;
   short nlink;
   uint size;
-  uint addrs[NDIRECT+1];
+  uint addrs[NDIRECT+2];
+  uint mapbn;         // bmap()'s cached run of contiguous blocks:
+  uint mapaddr;       // file blocks mapbn..mapbn+maplen-1 are at
+  uint maplen;        // disk blocks mapaddr..mapaddr+maplen-1
 };
 
 // map major device number to device functions.
+// read is also passed the file's offset, which fileread()
+// advances by what it returns.
 struct devsw {
-  int (*read)(int, uint64, int);
+  int (*read)(int, uint64, int, uint);
   int (*write)(int, uint64, int);
 };
 
 extern struct devsw devsw[];
 
 #define CONSOLE 1
+#define STATS   2
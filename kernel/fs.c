@@ -162,29 +162,78 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The itable.lock spin-lock protects the allocation of itable
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold itable.lock while using any of those fields.
+// The itable is a hash table keyed by (dev, inum), with a
+// spin-lock per bucket. A bucket's lock protects its chain and
+// the ip->ref of each inode on it. ip->dev and ip->inum only
+// change while an entry is on no chain, so holding a reference
+// to ip, or its bucket's lock, keeps them stable.
+//
+// iinit() sizes the table from the memory free at boot. An
+// entry whose ref falls to zero stays on its chain, still valid,
+// so a later iget() need not re-read it from disk; it also goes
+// on an LRU list, and iget() recycles the least recently used
+// such entry when the never-used ones run out. itable.lock
+// protects the LRU list and serializes recycling. A hit in
+// iget() does not take itable.lock, so an entry on the LRU list
+// may have been referenced again; recycling skips those.
+// Lock order: itable.lock, then a bucket lock.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
+#define NIBUCKET 251   // itable hash buckets
+#define IHASH(dev, inum) (((dev) * 31 + (inum)) % NIBUCKET)
+#define IMEMFRAC 256   // give inodes 1/IMEMFRAC of free memory
+
+struct ibucket {
+  struct spinlock lock;
+  struct inode *head;   // chain through inode.next
+  uint64 nhit;          // iget()s satisfied from this bucket
+};
+
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct inode *free;   // never-used entries, through inode.next
+  struct inode lru;     // unreferenced entries, through lrunext/lruprev
+  struct ibucket bucket[NIBUCKET];
+  int ninode;
+  uint64 nmiss;
+  uint64 nrecycle;
 } itable;
 
+static void dcacheinit(void);
+static void dcachepurge(struct inode *dp);
+
 void
 iinit()
 {
-  int i = 0;
-  
+  struct inode *ip;
+  char *pg;
+  int i, j, n, npage;
+
   initlock(&itable.lock, "itable");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&itable.inode[i].lock, "inode");
+  for(i = 0; i < NIBUCKET; i++)
+    initlock(&itable.bucket[i].lock, "itable.bucket");
+  itable.lru.lrunext = itable.lru.lruprev = &itable.lru;
+
+  n = PGSIZE / sizeof(struct inode);
+  npage = kfreepages() / IMEMFRAC;
+  if(npage * n < NINODE)
+    npage = (NINODE + n - 1) / n;
+  for(i = 0; i < npage; i++){
+    if((pg = kalloc()) == 0)
+      panic("iinit");
+    memset(pg, 0, PGSIZE);
+    for(j = 0; j < n; j++){
+      ip = (struct inode*)pg + j;
+      initsleeplock(&ip->lock, "inode");
+      ip->next = itable.free;
+      itable.free = ip;
+      itable.ninode++;
+    }
   }
+  dcacheinit();
 }
 
 static struct inode* iget(uint dev, uint inum);
@@ -236,37 +285,92 @@ iupdate(struct inode *ip)
   brelse(bp);
 }
 
+// Look for inode inum on device dev in bucket bk,
+// and take a reference to it if found.
+// Caller must hold bk->lock.
+static struct inode*
+ifind(struct ibucket *bk, uint dev, uint inum)
+{
+  struct inode *ip;
+
+  for(ip = bk->head; ip != 0; ip = ip->next){
+    if(ip->dev == dev && ip->inum == inum){
+      ip->ref++;
+      bk->nhit++;
+      return ip;
+    }
+  }
+  return 0;
+}
+
+// Take ip off the LRU list. Caller must hold itable.lock.
+static void
+lruremove(struct inode *ip)
+{
+  ip->lruprev->lrunext = ip->lrunext;
+  ip->lrunext->lruprev = ip->lruprev;
+  ip->inlru = 0;
+}
+
 // Find the inode with number inum on device dev
 // and return the in-memory copy. Does not lock
 // the inode and does not read it from disk.
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
-
+  struct ibucket *bk, *vbk;
+  struct inode *ip, **pp;
+
+  bk = &itable.bucket[IHASH(dev, inum)];
+  acquire(&bk->lock);
+  ip = ifind(bk, dev, inum);
+  release(&bk->lock);
+  if(ip)
+    return ip;
+
+  // Not in the table. Look again while holding itable.lock,
+  // since another CPU may have added it, and only one CPU
+  // at a time may add entries.
   acquire(&itable.lock);
-
-  // Is the inode already in the table?
-  empty = 0;
-  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
-      release(&itable.lock);
-      return ip;
+  acquire(&bk->lock);
+  ip = ifind(bk, dev, inum);
+  release(&bk->lock);
+  if(ip){
+    release(&itable.lock);
+    return ip;
+  }
+  itable.nmiss++;
+
+  if((ip = itable.free) != 0){
+    itable.free = ip->next;
+  } else {
+    // Recycle the least recently used unreferenced entry.
+    for(;;){
+      ip = itable.lru.lrunext;
+      if(ip == &itable.lru)
+        panic("iget: no inodes");
+      lruremove(ip);
+      vbk = &itable.bucket[IHASH(ip->dev, ip->inum)];
+      acquire(&vbk->lock);
+      if(ip->ref == 0)
+        break;
+      release(&vbk->lock);  // referenced again since iput()
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
+    for(pp = &vbk->head; *pp != ip; pp = &(*pp)->next)
+      ;
+    *pp = ip->next;
+    release(&vbk->lock);
+    itable.nrecycle++;
   }
 
-  // Recycle an inode entry.
-  if(empty == 0)
-    panic("iget: no inodes");
-
-  ip = empty;
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  acquire(&bk->lock);
+  ip->next = bk->head;
+  bk->head = ip;
+  release(&bk->lock);
   release(&itable.lock);
 
   return ip;
@@ -277,9 +381,11 @@ iget(uint dev, uint inum)
 struct inode*
 idup(struct inode *ip)
 {
-  acquire(&itable.lock);
+  struct ibucket *bk = &itable.bucket[IHASH(ip->dev, ip->inum)];
+
+  acquire(&bk->lock);
   ip->ref++;
-  release(&itable.lock);
+  release(&bk->lock);
   return ip;
 }
 
@@ -306,6 +412,7 @@ ilock(struct inode *ip)
     ip->size = dip->size;
     memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
     brelse(bp);
+    ip->maplen = 0;
     ip->valid = 1;
     if(ip->type == 0)
       panic("ilock: no type");
@@ -332,7 +439,10 @@ iunlock(struct inode *ip)
 void
 iput(struct inode *ip)
 {
-  acquire(&itable.lock);
+  struct ibucket *bk = &itable.bucket[IHASH(ip->dev, ip->inum)];
+  int ref;
+
+  acquire(&bk->lock);
 
   if(ip->ref == 1 && ip->valid && ip->nlink == 0){
     // inode has no links and no other references: truncate and free.
@@ -341,8 +451,10 @@ iput(struct inode *ip)
     // so this acquiresleep() won't block (or deadlock).
     acquiresleep(&ip->lock);
 
-    release(&itable.lock);
+    release(&bk->lock);
 
+    if(ip->type == T_DIR)
+      dcachepurge(ip);
     itrunc(ip);
     ip->type = 0;
     iupdate(ip);
@@ -350,11 +462,24 @@ iput(struct inode *ip)
 
     releasesleep(&ip->lock);
 
-    acquire(&itable.lock);
+    acquire(&bk->lock);
   }
 
-  ip->ref--;
-  release(&itable.lock);
+  ref = --ip->ref;
+  release(&bk->lock);
+
+  if(ref == 0){
+    // make ip the most recently used unreferenced entry.
+    acquire(&itable.lock);
+    if(ip->inlru)
+      lruremove(ip);
+    ip->lrunext = &itable.lru;
+    ip->lruprev = itable.lru.lruprev;
+    itable.lru.lruprev->lrunext = ip;
+    itable.lru.lruprev = ip;
+    ip->inlru = 1;
+    release(&itable.lock);
+  }
 }
 
 // Common idiom: unlock, then put.
@@ -365,21 +490,70 @@ iunlockput(struct inode *ip)
   iput(ip);
 }
 
+// Report inode table counters for the statistics device.
+int
+itablestats(char *buf, int sz)
+{
+  uint64 nhit = 0;
+
+  for(int i = 0; i < NIBUCKET; i++)
+    nhit += itable.bucket[i].nhit;
+  return snprintf(buf, sz, "itable: inodes %d hit %ld miss %ld recycle %ld\n",
+                  itable.ninode, nhit, itable.nmiss, itable.nrecycle);
+}
+
 // Inode content
 //
 // The content (data) associated with each inode is stored
 // in blocks on the disk. The first NDIRECT block numbers
 // are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+// listed in block ip->addrs[NDIRECT]. The next NDINDIRECT
+// blocks are listed in the NINDIRECT blocks whose numbers
+// are listed in block ip->addrs[NDIRECT+1].
+//
+// balloc() hands out blocks in order, so a file written
+// sequentially is mostly contiguous on disk. bmap() remembers
+// the run of contiguous blocks around the last block it looked
+// up in an indirect block, so sequential I/O reads each
+// indirect block once per run rather than once per block.
+
+// Return entry i of block-map block addr in inode ip,
+// allocating a block for it if there is none.
+// If run is not 0, set *run to the number of contiguous
+// disk blocks that start at the entry's block.
+static uint
+bmapind(struct inode *ip, uint addr, uint i, uint *run)
+{
+  uint *a, k;
+  struct buf *bp;
+
+  bp = bread(ip->dev, addr);
+  a = (uint*)bp->data;
+  if((addr = a[i]) == 0){
+    a[i] = addr = balloc(ip->dev);
+    log_write(bp);
+  }
+  if(run){
+    for(k = i + 1; k < NINDIRECT && a[k] == a[k-1] + 1; k++)
+      ;
+    *run = k - i;
+  }
+  brelse(bp);
+  return addr;
+}
 
 // Return the disk block address of the nth block in inode ip.
 // If there is no such block, bmap allocates one.
 static uint
 bmap(struct inode *ip, uint bn)
 {
-  uint addr, *a;
-  struct buf *bp;
+  uint addr, run, fbn;
+
+  // in the cached run? (unsigned, so bn < mapbn misses too.)
+  if(bn - ip->mapbn < ip->maplen)
+    return ip->mapaddr + (bn - ip->mapbn);
 
+  fbn = bn;
   if(bn < NDIRECT){
     if((addr = ip->addrs[bn]) == 0)
       ip->addrs[bn] = addr = balloc(ip->dev);
@@ -391,17 +565,45 @@ bmap(struct inode *ip, uint bn)
     // Load indirect block, allocating if necessary.
     if((addr = ip->addrs[NDIRECT]) == 0)
       ip->addrs[NDIRECT] = addr = balloc(ip->dev);
-    bp = bread(ip->dev, addr);
-    a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      a[bn] = addr = balloc(ip->dev);
-      log_write(bp);
-    }
-    brelse(bp);
-    return addr;
+    addr = bmapind(ip, addr, bn, &run);
+  } else if((bn -= NINDIRECT) < NDINDIRECT){
+    // Load double-indirect block, then the indirect
+    // block it points to, allocating if necessary.
+    if((addr = ip->addrs[NDIRECT+1]) == 0)
+      ip->addrs[NDIRECT+1] = addr = balloc(ip->dev);
+    addr = bmapind(ip, addr, bn / NINDIRECT, 0);
+    addr = bmapind(ip, addr, bn % NINDIRECT, &run);
+  } else {
+    panic("bmap: out of range");
   }
 
-  panic("bmap: out of range");
+  ip->mapbn = fbn;
+  ip->mapaddr = addr;
+  ip->maplen = run;
+  return addr;
+}
+
+// Free the blocks listed in block-map block addr, and addr itself.
+// If depth > 0, the listed blocks are block-map blocks too.
+static void
+bfreeind(uint dev, uint addr, int depth)
+{
+  struct buf *bp;
+  uint *a;
+  int j;
+
+  bp = bread(dev, addr);
+  a = (uint*)bp->data;
+  for(j = 0; j < NINDIRECT; j++){
+    if(a[j]){
+      if(depth > 0)
+        bfreeind(dev, a[j], depth - 1);
+      else
+        bfree(dev, a[j]);
+    }
+  }
+  brelse(bp);
+  bfree(dev, addr);
 }
 
 // Truncate inode (discard contents).
@@ -409,9 +611,7 @@ bmap(struct inode *ip, uint bn)
 void
 itrunc(struct inode *ip)
 {
-  int i, j;
-  struct buf *bp;
-  uint *a;
+  int i;
 
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
@@ -421,17 +621,17 @@ itrunc(struct inode *ip)
   }
 
   if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
-    a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j])
-        bfree(ip->dev, a[j]);
-    }
-    brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
+    bfreeind(ip->dev, ip->addrs[NDIRECT], 0);
     ip->addrs[NDIRECT] = 0;
   }
 
+  if(ip->addrs[NDIRECT+1]){
+    bfreeind(ip->dev, ip->addrs[NDIRECT+1], 1);
+    ip->addrs[NDIRECT+1] = 0;
+  }
+
+  ip->maplen = 0;
+  pcacheinval(ip, 0, ip->size);
   ip->size = 0;
   iupdate(ip);
 }
@@ -452,17 +652,29 @@ stati(struct inode *ip, struct stat *st)
 // Caller must hold ip->lock.
 // If user_dst==1, then dst is a user virtual address;
 // otherwise, dst is a kernel address.
+// Regular files are read through the page cache.
 int
 readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 {
-  uint tot, m;
-  struct buf *bp;
-
   if(off > ip->size || off + n < off)
     return 0;
   if(off + n > ip->size)
     n = ip->size - off;
 
+  if(ip->type == T_FILE)
+    return pcacheread(ip, user_dst, dst, off, n);
+  return readblocks(ip, user_dst, dst, off, n);
+}
+
+// Read n bytes of the inode at off, which the caller
+// has checked are in the file, through the buffer cache.
+// Caller must hold ip->lock.
+int
+readblocks(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
+{
+  uint tot, m;
+  struct buf *bp;
+
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
     bp = bread(ip->dev, bmap(ip, off/BSIZE));
     m = min(n - tot, BSIZE - off%BSIZE);
@@ -501,6 +713,8 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
       brelse(bp);
       break;
     }
+    if(ip->type == T_FILE)
+      pcachewrite(ip, off, (char*)bp->data + (off % BSIZE), m);
     log_write(bp);
     brelse(bp);
   }
@@ -516,7 +730,161 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
   return tot;
 }
 
+// Name cache.
+//
+// Caches the results of directory lookups, mapping (dev,
+// directory inum, name) to an inum, or to 0 to record that
+// the name is absent (a negative entry). namex() consults it
+// before locking and scanning each directory on a path.
+// Entries are only added or changed by code that holds the
+// directory's lock: dirlookup(), dirlink(), and sys_unlink()
+// via dcacheremove(). A directory's entries are purged when
+// its inode is freed, so a cached directory inum is always
+// still a directory.
+//
+// The cache is set-associative: a name maps to one set of
+// DCWAYS entries, and a new entry replaces the least recently
+// used entry of its set.
+
+#define DCSETS 64
+#define DCWAYS 4
+
+struct dentry {
+  uint dev;
+  uint dinum;        // directory, or 0 if the entry is unused
+  uint inum;         // 0 for a negative entry
+  uint lastuse;
+  char name[DIRSIZ];
+};
+
+struct {
+  struct spinlock lock;
+  struct dentry set[DCSETS][DCWAYS];
+  uint clock;
+  uint64 nhit;
+  uint64 nneg;       // hits on negative entries
+  uint64 nmiss;
+} dcache;
+
+static void
+dcacheinit(void)
+{
+  initlock(&dcache.lock, "dcache");
+}
+
+// Find the entry for name in directory dinum. If victim is
+// not 0, set *victim to the entry to replace if there is none.
+// Caller must hold dcache.lock.
+static struct dentry*
+dcfind(uint dev, uint dinum, char *name, struct dentry **victim)
+{
+  struct dentry *set, *d;
+
+  set = dcache.set[(dirhash(name) ^ dinum) % DCSETS];
+  if(victim)
+    *victim = &set[0];
+  for(d = set; d < set + DCWAYS; d++){
+    if(d->dinum == dinum && d->dev == dev && namecmp(d->name, name) == 0)
+      return d;
+    if(victim && (d->dinum == 0 || d->lastuse < (*victim)->lastuse))
+      *victim = d;
+  }
+  return 0;
+}
+
+// Record that name in directory dp refers to inum,
+// or is absent if inum is 0. Caller must hold dp->lock.
+static void
+dcacheenter(struct inode *dp, char *name, uint inum)
+{
+  struct dentry *d, *victim;
+
+  acquire(&dcache.lock);
+  if((d = dcfind(dp->dev, dp->inum, name, &victim)) == 0){
+    d = victim;
+    d->dev = dp->dev;
+    d->dinum = dp->inum;
+    strncpy(d->name, name, DIRSIZ);
+  }
+  d->inum = inum;
+  d->lastuse = ++dcache.clock;
+  release(&dcache.lock);
+}
+
+// Look up name in directory dp, which need not be locked.
+// On a hit, return 1 and set *ipp to the inode, or to 0 if
+// the name is known to be absent. On a miss, return 0.
+// The inode is referenced while dcache.lock is held, so it
+// cannot be freed by a concurrent unlink in between.
+static int
+dcachelookup(struct inode *dp, char *name, struct inode **ipp)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  if((d = dcfind(dp->dev, dp->inum, name, 0)) == 0){
+    dcache.nmiss++;
+    release(&dcache.lock);
+    return 0;
+  }
+  d->lastuse = ++dcache.clock;
+  if(d->inum){
+    dcache.nhit++;
+    *ipp = iget(dp->dev, d->inum);
+  } else {
+    dcache.nneg++;
+    *ipp = 0;
+  }
+  release(&dcache.lock);
+  return 1;
+}
+
+// name has been removed from directory dp.
+// Caller must hold dp->lock.
+void
+dcacheremove(struct inode *dp, char *name)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  if((d = dcfind(dp->dev, dp->inum, name, 0)) != 0)
+    d->inum = 0;
+  release(&dcache.lock);
+}
+
+// Directory dp is being freed: forget its entries.
+static void
+dcachepurge(struct inode *dp)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  for(d = &dcache.set[0][0]; d < &dcache.set[DCSETS][0]; d++){
+    if(d->dinum == dp->inum && d->dev == dp->dev)
+      d->dinum = 0;
+  }
+  release(&dcache.lock);
+}
+
+// Report name cache counters for the statistics device.
+int
+dcachestats(char *buf, int sz)
+{
+  uint64 n = dcache.nhit + dcache.nneg + dcache.nmiss;
+
+  return snprintf(buf, sz, "dcache: hit %ld negative %ld miss %ld ratio %d%%\n",
+                  dcache.nhit, dcache.nneg, dcache.nmiss,
+                  n ? (int)((dcache.nhit + dcache.nneg) * 100 / n) : 0);
+}
+
 // Directories
+//
+// Small directories are flat arrays of dirents. A directory
+// that outgrows one block is converted to the indexed format
+// described in fs.h, so that lookups and inserts read only
+// the header and one bucket, however large it grows.
+// Flat directories of more than one block, which mkfs or an
+// older kernel may have made, are still read and written flat.
 
 int
 namecmp(const char *s, const char *t)
@@ -524,6 +892,226 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
+// Is dp an indexed directory?
+static int
+dirindexed(struct inode *dp)
+{
+  struct buf *bp;
+  ushort *h;
+  int r;
+
+  if(dp->size < BSIZE)
+    return 0;
+  bp = bread(dp->dev, bmap(dp, 0));
+  h = (ushort*)bp->data;
+  // a flat directory's first dirent is ".", so inum != 0.
+  r = h[0] == 0 && h[1] == DIRMAGIC;
+  brelse(bp);
+  return r;
+}
+
+// Look for name in indexed directory dp.
+// If found, set *poff to byte offset of entry
+// and return its inum; otherwise return 0.
+static uint
+dxlookup(struct inode *dp, char *name, uint *poff)
+{
+  struct buf *bp;
+  struct dirent *de;
+  ushort *h;
+  uint blk, hash, inum;
+  int i;
+
+  hash = dirhash(name);
+  bp = bread(dp->dev, bmap(dp, 0));
+  h = (ushort*)bp->data;
+  blk = h[DIRTAB(hash & ((1 << h[2]) - 1))];
+  brelse(bp);
+
+  while(blk != 0){
+    bp = bread(dp->dev, bmap(dp, blk));
+    de = (struct dirent*)bp->data;
+    for(i = 1; i < DPB; i++){
+      if(de[i].inum != 0 && namecmp(name, de[i].name) == 0){
+        if(poff)
+          *poff = blk*BSIZE + i*sizeof(struct dirent);
+        inum = de[i].inum;
+        brelse(bp);
+        return inum;
+      }
+    }
+    blk = ((ushort*)bp->data)[3];
+    brelse(bp);
+  }
+  return 0;
+}
+
+// Append a zeroed bucket with local depth ldepth to indexed
+// directory dp. Returns its locked buf; *pblk is set to its
+// block number within dp.
+static struct buf*
+dxgrow(struct inode *dp, uint ldepth, uint *pblk)
+{
+  struct buf *bp;
+  ushort *h;
+
+  *pblk = dp->size / BSIZE;
+  bp = bread(dp->dev, bmap(dp, *pblk));  // balloc() zeroed it
+  dp->size += BSIZE;
+  iupdate(dp);
+  h = (ushort*)bp->data;
+  h[1] = DIRMAGIC;
+  h[2] = ldepth;
+  return bp;
+}
+
+// Add (name, inum) to indexed directory dp. If the entry's
+// bucket is full, split it, doubling the table if need be,
+// and try again; once the table can't grow, chain a new
+// bucket onto the full one instead.
+// Names that collide can split one bucket DIRDEPTH-1 times
+// and then chain, so one insert may write the header,
+// DIRDEPTH+1 buckets, dp's inode, two bitmap blocks and
+// three indirect blocks: 16. With create()'s own inode and
+// data blocks that is 18, which MAXOPBLOCKS must cover.
+static void
+dxinsert(struct inode *dp, char *name, uint inum)
+{
+  struct buf *hb, *bp, *nbp;
+  struct dirent *de, *nde;
+  ushort *h, *bh;
+  uint hash, blk, nblk, depth, ldepth;
+  int i, n;
+
+  hash = dirhash(name);
+  for(;;){
+    hb = bread(dp->dev, bmap(dp, 0));
+    h = (ushort*)hb->data;
+    depth = h[2];
+    blk = h[DIRTAB(hash & ((1 << depth) - 1))];
+
+    // Look for an empty dirent along the chain.
+    for(;;){
+      bp = bread(dp->dev, bmap(dp, blk));
+      de = (struct dirent*)bp->data;
+      for(i = 1; i < DPB; i++){
+        if(de[i].inum == 0){
+          strncpy(de[i].name, name, DIRSIZ);
+          de[i].inum = inum;
+          log_write(bp);
+          brelse(bp);
+          brelse(hb);
+          return;
+        }
+      }
+      bh = (ushort*)bp->data;
+      if(bh[3] == 0)
+        break;
+      blk = bh[3];
+      brelse(bp);
+    }
+
+    // bp is the full last bucket of the chain.
+    ldepth = bh[2];
+    if(ldepth >= DIRDEPTH){
+      nbp = dxgrow(dp, ldepth, &nblk);
+      bh[3] = nblk;
+      nde = (struct dirent*)nbp->data;
+      strncpy(nde[1].name, name, DIRSIZ);
+      nde[1].inum = inum;
+      log_write(nbp);
+      log_write(bp);
+      brelse(nbp);
+      brelse(bp);
+      brelse(hb);
+      return;
+    }
+
+    if(ldepth == depth){
+      // double the table; the new half aliases the old.
+      for(i = 0; i < (1 << depth); i++)
+        h[DIRTAB(i + (1 << depth))] = h[DIRTAB(i)];
+      h[2] = ++depth;
+    }
+
+    // split: entries with hash bit ldepth set move to a
+    // new bucket, as do the table slots with that bit set.
+    nbp = dxgrow(dp, ldepth + 1, &nblk);
+    bh[2] = ldepth + 1;
+    nde = (struct dirent*)nbp->data;
+    n = 1;
+    for(i = 1; i < DPB; i++){
+      if(de[i].inum != 0 && ((dirhash(de[i].name) >> ldepth) & 1)){
+        nde[n++] = de[i];
+        memset(&de[i], 0, sizeof(de[i]));
+      }
+    }
+    for(i = 0; i < (1 << depth); i++){
+      if(h[DIRTAB(i)] == blk && ((i >> ldepth) & 1))
+        h[DIRTAB(i)] = nblk;
+    }
+    log_write(nbp);
+    log_write(bp);
+    log_write(hb);
+    brelse(nbp);
+    brelse(bp);
+    brelse(hb);
+  }
+}
+
+// Convert flat directory dp, whose one block is full, to an
+// indexed directory with two buckets.
+static void
+dxconvert(struct inode *dp)
+{
+  struct buf *hb, *bp[2];
+  struct dirent *de, *bde, extra;
+  ushort *h;
+  int i, b, n[2];
+
+  if(dp->size != BSIZE)
+    panic("dxconvert");
+  hb = bread(dp->dev, bmap(dp, 0));
+  bp[0] = bread(dp->dev, bmap(dp, 1));
+  bp[1] = bread(dp->dev, bmap(dp, 2));
+  dp->size = 3*BSIZE;
+  iupdate(dp);
+
+  // move the entries into the buckets. if all DPB of them
+  // hash to one bucket, one is left over.
+  de = (struct dirent*)hb->data;
+  extra.inum = 0;
+  n[0] = n[1] = 1;
+  for(i = 0; i < DPB; i++){
+    b = dirhash(de[i].name) & 1;
+    if(n[b] < DPB){
+      bde = (struct dirent*)bp[b]->data;
+      bde[n[b]++] = de[i];
+    } else {
+      extra = de[i];
+    }
+  }
+
+  memset(hb->data, 0, BSIZE);
+  h = (ushort*)hb->data;
+  h[1] = DIRMAGIC;
+  h[2] = 1;
+  h[DIRTAB(0)] = 1;
+  h[DIRTAB(1)] = 2;
+  for(b = 0; b < 2; b++){
+    h = (ushort*)bp[b]->data;
+    h[1] = DIRMAGIC;
+    h[2] = 1;
+    log_write(bp[b]);
+    brelse(bp[b]);
+  }
+  log_write(hb);
+  brelse(hb);
+
+  if(extra.inum != 0)
+    dxinsert(dp, extra.name, extra.inum);
+}
+
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
 struct inode*
@@ -535,6 +1123,14 @@ dirlookup(struct inode *dp, char *name, uint *poff)
   if(dp->type != T_DIR)
     panic("dirlookup not DIR");
 
+  if(dirindexed(dp)){
+    inum = dxlookup(dp, name, poff);
+    dcacheenter(dp, name, inum);
+    if(inum == 0)
+      return 0;
+    return iget(dp->dev, inum);
+  }
+
   for(off = 0; off < dp->size; off += sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
       panic("dirlookup read");
@@ -545,10 +1141,12 @@ dirlookup(struct inode *dp, char *name, uint *poff)
       if(poff)
         *poff = off;
       inum = de.inum;
+      dcacheenter(dp, name, inum);
       return iget(dp->dev, inum);
     }
   }
 
+  dcacheenter(dp, name, 0);
   return 0;
 }
 
@@ -566,6 +1164,13 @@ dirlink(struct inode *dp, char *name, uint inum)
     return -1;
   }
 
+  dcacheenter(dp, name, inum);
+
+  if(dirindexed(dp)){
+    dxinsert(dp, name, inum);
+    return 0;
+  }
+
   // Look for an empty dirent.
   for(off = 0; off < dp->size; off += sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
@@ -574,6 +1179,13 @@ dirlink(struct inode *dp, char *name, uint inum)
       break;
   }
 
+  if(off == BSIZE && dp->size == BSIZE){
+    // the first block is full: switch to the indexed format.
+    dxconvert(dp);
+    dxinsert(dp, name, inum);
+    return 0;
+  }
+
   strncpy(de.name, name, DIRSIZ);
   de.inum = inum;
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
@@ -624,6 +1236,7 @@ skipelem(char *path, char *name)
 // Look up and return the inode for a path name.
 // If parent != 0, return the inode for the parent and copy the final
 // path element into name, which must have room for DIRSIZ bytes.
+// Components found in the name cache need no directory lock or scan.
 // Must be called inside a transaction since it calls iput().
 static struct inode*
 namex(char *path, int nameiparent, char *name)
@@ -636,6 +1249,14 @@ namex(char *path, int nameiparent, char *name)
     ip = idup(myproc()->cwd);
 
   while((path = skipelem(path, name)) != 0){
+    if(!(nameiparent && *path == '\0') && dcachelookup(ip, name, &next)){
+      // ip is a directory, since the cache has entries for it.
+      iput(ip);
+      if(next == 0)
+        return 0;
+      ip = next;
+      continue;
+    }
     ilock(ip);
     if(ip->type != T_DIR){
       iunlockput(ip);
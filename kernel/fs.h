@@ -24,9 +24,10 @@ struct superblock {
 
 #define FSMAGIC 0x10203040
 
-#define NDIRECT 12
+#define NDIRECT 11
 #define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+#define NDINDIRECT (NINDIRECT * NINDIRECT)
+#define MAXFILE (NDIRECT + NINDIRECT + NDINDIRECT)
 
 // On-disk inode structure
 struct dinode {
@@ -35,7 +36,7 @@ struct dinode {
   short minor;          // Minor device number (T_DEVICE only)
   short nlink;          // Number of links to inode in file system
   uint size;            // Size of file (bytes)
-  uint addrs[NDIRECT+1];   // Data block addresses
+  uint addrs[NDIRECT+2];   // Data block addresses
 };
 
 // Inodes per block.
@@ -58,3 +59,40 @@ struct dirent {
   char name[DIRSIZ];
 };
 
+#define DPB (BSIZE / sizeof(struct dirent))  // dirents per block
+
+// Indexed directories.
+//
+// A directory that outgrows one block becomes an extendible
+// hash table: block 0 is a header, and every other block is a
+// bucket of dirents. The header and the first dirent slot of
+// each bucket have zeros wherever a dirent's inum would be, so
+// programs that read a directory as an array of dirents, like
+// ls, see only the real entries.
+//
+// Viewed as an array of ushorts, the header holds
+//   [0] 0, [1] DIRMAGIC, [2] global depth, and at DIRTAB(i),
+//   for i < 1<<depth, the first block of bucket i.
+// The first slot of a bucket holds
+//   [0] 0, [1] DIRMAGIC, [2] local depth,
+//   [3] next overflow block in the chain, or 0.
+// An entry lives in the chain of bucket dirhash(name) mod
+// 1<<depth. Overflow chains only form once the global
+// depth has reached DIRDEPTH.
+#define DIRMAGIC 0x7864          // "dx"
+#define DIRDEPTH 8               // maximum global depth
+#define DIRTAB(i) (9 + (i) + (i)/7)  // skips every 8th ushort
+
+// FNV-1a hash of a directory entry name.
+static inline uint
+dirhash(const char *name)
+{
+  uint h = 2166136261U;
+
+  for(int i = 0; i < DIRSIZ && name[i]; i++){
+    h ^= (uchar)name[i];
+    h *= 16777619U;
+  }
+  return h;
+}
+
@@ -1,6 +1,26 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers. Allocates whole 4096-byte pages, or
+// physically contiguous blocks of 2^order pages.
+//
+// Each CPU keeps its own free list of single pages, so the
+// common kalloc() and kfree() paths take only an uncontended
+// per-CPU lock. A CPU whose list runs dry refills a batch of
+// pages from the shared pool, and if the pool is empty too,
+// steals half of a sibling CPU's list. A CPU whose list grows
+// past KHIGH drains a batch back to the pool, so that pages
+// freed on one CPU can be reused on the others.
+//
+// The shared pool is a buddy allocator. A free block of order k
+// is 2^k pages, aligned to its size, and has one buddy of the
+// same order that it merges with when both are free. Blocks
+// are split to satisfy smaller requests, so kalloc_pages() can
+// hand out contiguous memory for as long as fragmentation allows.
+//
+// kinit() does not touch free memory. Pages that have never
+// been allocated are tracked as one range, from kmem.lazy up to
+// PHYSTOP, and carve() adds them to the pool a block at a time
+// when it runs out, so boot time does not grow with the size of RAM.
 
 #include "types.h"
 #include "param.h"
@@ -9,7 +29,12 @@
 #include "riscv.h"
 #include "defs.h"
 
-void freerange(void *pa_start, void *pa_end);
+#define KBATCH 32          // pages moved per refill or drain
+#define KHIGH  (2*KBATCH)  // drain a per-CPU list beyond this
+#define MAXORDER 10        // largest block is 2^MAXORDER pages (4 MB)
+#define FRAGORDER 4        // order that the fragmentation figure is for
+#define NPAGE ((PHYSTOP - KERNBASE) / PGSIZE)
+#define PA2PG(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
 
 extern char end[]; // first address after kernel.
                    // defined by kernel.ld.
@@ -18,48 +43,264 @@ struct run {
   struct run *next;
 };
 
+// a free block in the pool, on a circular list per order.
+struct block {
+  struct block *next;
+  struct block *prev;
+};
+
+// the shared pool.
 struct {
   struct spinlock lock;
-  struct run *freelist;
+  struct block free[MAXORDER+1];  // list heads, by order
+  int nblock[MAXORDER+1];         // blocks on each list
+  int nfree;        // pages in all free blocks
+  char *lazy;       // pages from here to PHYSTOP never allocated
+  uint64 nrefill;   // batches handed to CPUs
+  uint64 ndrain;    // batches returned by CPUs
+  uint64 nsplit;    // blocks split in two
+  uint64 nmerge;    // buddies merged
+  uint64 nfail[MAXORDER+1]; // kalloc_pages() found no block
 } kmem;
 
+// for each page, 1 + the order of the free pool block it
+// starts, or 0. how a block finds out whether its buddy is free.
+static uchar freeorder[NPAGE];
+
+// reference counts for physical pages, which copy-on-write
+// fork shares between page tables. kfree() only returns a
+// page to a free list once its count falls to zero.
+// updated with atomic instructions, not a lock.
+#define PA2REF(pa) (pgref[((uint64)(pa) - KERNBASE) / PGSIZE])
+static int pgref[NPAGE];
+
+// per-CPU free lists. the lock is only contended
+// when another CPU steals from this one.
+struct kcpu {
+  struct spinlock lock;
+  struct run *freelist;
+  int nfree;
+  uint64 nhit;      // kalloc() served from this list
+  uint64 nmiss;     // kalloc() found this list empty
+  uint64 nsteal;    // misses satisfied by stealing
+} kcpus[NCPU];
+
 void
 kinit()
 {
   initlock(&kmem.lock, "kmem");
-  freerange(end, (void*)PHYSTOP);
+  for(int i = 0; i < NCPU; i++)
+    initlock(&kcpus[i].lock, "kmem_cpu");
+  for(int k = 0; k <= MAXORDER; k++)
+    kmem.free[k].next = kmem.free[k].prev = &kmem.free[k];
+  kmem.lazy = (char*)PGROUNDUP((uint64)end);
 }
 
-void
-freerange(void *pa_start, void *pa_end)
+// Put block b on the free list for order k.
+// Caller must hold kmem.lock.
+static void
+bpush(struct block *b, int k)
+{
+  b->next = kmem.free[k].next;
+  b->prev = &kmem.free[k];
+  b->next->prev = b;
+  kmem.free[k].next = b;
+  freeorder[PA2PG(b)] = k + 1;
+  kmem.nblock[k]++;
+  kmem.nfree += 1 << k;
+}
+
+// Take block b off the free list for order k.
+// Caller must hold kmem.lock.
+static void
+bremove(struct block *b, int k)
+{
+  b->prev->next = b->next;
+  b->next->prev = b->prev;
+  freeorder[PA2PG(b)] = 0;
+  kmem.nblock[k]--;
+  kmem.nfree -= 1 << k;
+}
+
+// Return the block of order k at pa to the pool, merging
+// it with its buddy for as long as the buddy is free too.
+// Caller must hold kmem.lock.
+static void
+bfree(char *pa, int k)
+{
+  char *buddy;
+
+  for(; k < MAXORDER; k++){
+    buddy = (char*)(KERNBASE + (((uint64)pa - KERNBASE) ^ ((uint64)PGSIZE << k)));
+    if((uint64)buddy >= PHYSTOP || freeorder[PA2PG(buddy)] != k + 1)
+      break;
+    bremove((struct block*)buddy, k);
+    kmem.nmerge++;
+    if(buddy < pa)
+      pa = buddy;
+  }
+  bpush((struct block*)pa, k);
+}
+
+// Move the largest aligned block at the start of the
+// never-used range into the pool. Returns 0 if the
+// range is used up. Caller must hold kmem.lock.
+static int
+carve(void)
+{
+  uint64 off;
+  int k;
+
+  if(kmem.lazy + PGSIZE > (char*)PHYSTOP)
+    return 0;
+  off = (uint64)kmem.lazy - KERNBASE;
+  for(k = MAXORDER; k > 0; k--){
+    if(off % ((uint64)PGSIZE << k) == 0 &&
+       kmem.lazy + ((uint64)PGSIZE << k) <= (char*)PHYSTOP)
+      break;
+  }
+  bfree(kmem.lazy, k);
+  kmem.lazy += (uint64)PGSIZE << k;
+  return 1;
+}
+
+// Take a block of order k from the pool, splitting a larger
+// block if there is none of that size. Returns 0 if no block
+// is big enough. Caller must hold kmem.lock.
+static char*
+balloc(int k)
+{
+  struct block *b;
+  int j;
+
+  for(;;){
+    for(j = k; j <= MAXORDER; j++)
+      if(kmem.free[j].next != &kmem.free[j])
+        break;
+    if(j <= MAXORDER)
+      break;
+    if(carve() == 0)
+      return 0;
+  }
+
+  b = kmem.free[j].next;
+  bremove(b, j);
+  // give back the upper halves.
+  while(j > k){
+    j--;
+    bpush((struct block*)((char*)b + ((uint64)PGSIZE << j)), j);
+    kmem.nsplit++;
+  }
+  return (char*)b;
+}
+
+// Move up to n pages from the shared pool onto list kc.
+// Returns the number of pages moved.
+// Caller must hold kc->lock.
+static int
+refill(struct kcpu *kc, int n)
+{
+  struct run *r;
+  int i;
+
+  acquire(&kmem.lock);
+  for(i = 0; i < n && (r = (struct run*)balloc(0)) != 0; i++){
+    r->next = kc->freelist;
+    kc->freelist = r;
+  }
+  if(i > 0)
+    kmem.nrefill++;
+  release(&kmem.lock);
+
+  kc->nfree += i;
+  return i;
+}
+
+// Take half of some other CPU's free list.
+// Returns a chain of *np pages, or 0 if every list is empty.
+// Must not hold any kcpus[].lock, to avoid deadlock with a
+// sibling that is stealing at the same time.
+static struct run*
+steal(int id, int *np)
 {
-  char *p;
-  p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p);
+  struct kcpu *victim;
+  struct run *head, *tail;
+  int i, n;
+
+  for(i = 1; i < NCPU; i++){
+    victim = &kcpus[(id + i) % NCPU];
+    acquire(&victim->lock);
+    if(victim->nfree > 0){
+      n = (victim->nfree + 1) / 2;
+      head = tail = victim->freelist;
+      for(int j = 1; j < n; j++)
+        tail = tail->next;
+      victim->freelist = tail->next;
+      victim->nfree -= n;
+      release(&victim->lock);
+      tail->next = 0;
+      *np = n;
+      return head;
+    }
+    release(&victim->lock);
+  }
+  *np = 0;
+  return 0;
 }
 
-// Free the page of physical memory pointed at by v,
-// which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// Drop a reference to the page of physical memory pointed
+// at by pa, which should have been returned by a call to
+// kalloc(). The page is freed when the last reference goes.
 void
 kfree(void *pa)
 {
-  struct run *r;
+  struct run *r, *head, *tail;
+  struct kcpu *kc;
+  int i, ref;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  if((ref = __sync_sub_and_fetch(&PA2REF(pa), 1)) > 0)
+    return;
+  if(ref < 0)
+    panic("kfree: ref");
+
+#ifdef KJUNK
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
+#endif
 
   r = (struct run*)pa;
+  head = 0;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  push_off();
+  kc = &kcpus[cpuid()];
+  acquire(&kc->lock);
+  r->next = kc->freelist;
+  kc->freelist = r;
+  kc->nfree++;
+  if(kc->nfree > KHIGH){
+    // detach a batch to hand back to the pool.
+    head = tail = kc->freelist;
+    for(i = 1; i < KBATCH; i++)
+      tail = tail->next;
+    kc->freelist = tail->next;
+    kc->nfree -= KBATCH;
+  }
+  release(&kc->lock);
+
+  if(head){
+    acquire(&kmem.lock);
+    tail->next = 0;
+    for(r = head; r; r = head){
+      head = r->next;
+      bfree((char*)r, 0);
+    }
+    kmem.ndrain++;
+    release(&kmem.lock);
+  }
+  pop_off();
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -68,15 +309,193 @@ kfree(void *pa)
 void *
 kalloc(void)
 {
-  struct run *r;
+  struct run *r, *chain;
+  struct kcpu *kc;
+  int id, n;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+  push_off();
+  id = cpuid();
+  kc = &kcpus[id];
+
+  acquire(&kc->lock);
+  if(kc->freelist)
+    kc->nhit++;
+  else {
+    kc->nmiss++;
+    refill(kc, KBATCH);
+  }
+  r = kc->freelist;
+  if(r){
+    kc->freelist = r->next;
+    kc->nfree--;
+  }
+  release(&kc->lock);
+
+  if(r == 0 && (chain = steal(id, &n)) != 0){
+    // keep the first stolen page, queue the rest locally.
+    r = chain;
+    acquire(&kc->lock);
+    kc->nsteal++;
+    if(n > 1){
+      struct run *tail = chain->next;
+      while(tail->next)
+        tail = tail->next;
+      tail->next = kc->freelist;
+      kc->freelist = chain->next;
+      kc->nfree += n - 1;
+    }
+    release(&kc->lock);
+  }
+  pop_off();
 
-  if(r)
+  if(r){
+    PA2REF(r) = 1;
+#ifdef KJUNK
     memset((char*)r, 5, PGSIZE); // fill with junk
+#endif
+  } else if(pcachereclaim(KBATCH) > 0){
+    // the page cache gave back some unmapped pages.
+    return kalloc();
+  }
   return (void*)r;
 }
+
+// Allocate 2^order physically contiguous pages, aligned to
+// their size, for use as one object. Returns 0 if there is no
+// free block that large. Order 0 is the same as kalloc().
+void *
+kalloc_pages(int order)
+{
+  char *pa;
+
+  if(order == 0)
+    return kalloc();
+  if(order < 0 || order > MAXORDER)
+    return 0;
+
+  acquire(&kmem.lock);
+  if((pa = balloc(order)) == 0)
+    kmem.nfail[order]++;
+  release(&kmem.lock);
+
+  if(pa){
+    for(int i = 0; i < (1 << order); i++)
+      PA2REF(pa + i*PGSIZE) = 1;
+#ifdef KJUNK
+    memset(pa, 5, (uint64)PGSIZE << order); // fill with junk
+#endif
+  }
+  return pa;
+}
+
+// Free a block returned by kalloc_pages(order).
+// Only order 0 blocks may be shared with kdup().
+void
+kfree_pages(void *pa, int order)
+{
+  if(order == 0){
+    kfree(pa);
+    return;
+  }
+  if(order < 0 || order > MAXORDER ||
+     ((uint64)pa - KERNBASE) % ((uint64)PGSIZE << order) != 0 ||
+     (char*)pa < end || (uint64)pa + ((uint64)PGSIZE << order) > PHYSTOP)
+    panic("kfree_pages");
+
+  for(int i = 0; i < (1 << order); i++){
+    if(PA2REF((char*)pa + i*PGSIZE) != 1)
+      panic("kfree_pages: ref");
+    PA2REF((char*)pa + i*PGSIZE) = 0;
+  }
+#ifdef KJUNK
+  memset(pa, 1, (uint64)PGSIZE << order);
+#endif
+
+  acquire(&kmem.lock);
+  bfree(pa, order);
+  release(&kmem.lock);
+}
+
+// Add a reference to an allocated page, e.g. when a
+// copy-on-write fork maps it into a second page table.
+void
+kdup(void *pa)
+{
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("kdup");
+  if(__sync_fetch_and_add(&PA2REF(pa), 1) < 1)
+    panic("kdup: free page");
+}
+
+// Drop a reference to an allocated page, unless it is the
+// last one. Returns 1 if it dropped one, or 0 if the caller
+// holds the last reference and should free the page's contents.
+int
+kdrop(void *pa)
+{
+  int ref;
+
+  do {
+    ref = __atomic_load_n(&PA2REF(pa), __ATOMIC_SEQ_CST);
+    if(ref <= 1)
+      return 0;
+  } while(!__sync_bool_compare_and_swap(&PA2REF(pa), ref, ref - 1));
+  return 1;
+}
+
+// Number of references to an allocated page.
+int
+krefcnt(void *pa)
+{
+  return __atomic_load_n(&PA2REF(pa), __ATOMIC_SEQ_CST);
+}
+
+// Number of free pages, summed over the pool and all CPUs.
+// Only a snapshot: other CPUs may be allocating concurrently.
+uint64
+kfreepages(void)
+{
+  uint64 n;
+
+  n = kmem.nfree + ((char*)PHYSTOP - kmem.lazy) / PGSIZE;
+  for(int i = 0; i < NCPU; i++)
+    n += kcpus[i].nfree;
+  return n;
+}
+
+// Report allocator counters for the statistics device.
+// frag is the percentage of the pool's free pages that are
+// in blocks too small for an order FRAGORDER allocation.
+int
+kallocstats(char *buf, int sz)
+{
+  int n, k, small;
+
+  acquire(&kmem.lock);
+  n = snprintf(buf, sz, "kalloc: pool free %d never used %d refill %ld drain %ld\n",
+               kmem.nfree, (int)(((char*)PHYSTOP - kmem.lazy) / PGSIZE),
+               kmem.nrefill, kmem.ndrain);
+  n += snprintf(buf+n, sz-n, "kalloc: blocks");
+  small = 0;
+  for(k = 0; k <= MAXORDER; k++){
+    n += snprintf(buf+n, sz-n, " %d", kmem.nblock[k]);
+    if(k < FRAGORDER)
+      small += kmem.nblock[k] << k;
+  }
+  n += snprintf(buf+n, sz-n, " split %ld merge %ld frag %d%%\n",
+                kmem.nsplit, kmem.nmerge,
+                kmem.nfree ? small * 100 / kmem.nfree : 0);
+  for(k = 1; k <= MAXORDER; k++)
+    if(kmem.nfail[k])
+      n += snprintf(buf+n, sz-n, "kalloc: order %d failed %ld\n", k, kmem.nfail[k]);
+  release(&kmem.lock);
+
+  for(int i = 0; i < NCPU; i++){
+    struct kcpu *kc = &kcpus[i];
+    if(kc->nhit == 0 && kc->nmiss == 0 && kc->nfree == 0)
+      continue;
+    n += snprintf(buf+n, sz-n, "kalloc: cpu%d free %d hit %ld miss %ld steal %ld\n",
+                  i, kc->nfree, kc->nhit, kc->nmiss, kc->nsteal);
+  }
+  return n;
+}
@@ -10,8 +10,8 @@
 // Simple logging that allows concurrent FS system calls.
 //
 // A log transaction contains the updates of multiple FS system
-// calls. The logging system only commits when there are
-// no FS system calls active. Thus there is never
+// calls. The logging system only closes a transaction when there
+// are no FS system calls active. Thus there is never
 // any reasoning required about whether a commit might
 // write an uncommitted system call's updates to disk.
 //
@@ -19,7 +19,17 @@
 // its start and end. Usually begin_op() just increments
 // the count of in-progress FS system calls and returns.
 // But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// sleeps until the log thread has closed the transaction.
+//
+// Commits are done by a kernel thread, logd, not by end_op().
+// logd closes the open transaction by copying its blocks out
+// of the buffer cache, lets new FS system calls start filling
+// the next transaction, and then writes the copies to the log
+// and to their home locations. Transactions that complete
+// while a commit is being written are grouped into the next
+// commit. So end_op() returns before the system call's
+// updates are on disk, but they reach the disk in order and
+// atomically.
 //
 // The log is a physical re-do log containing disk blocks.
 // The on-disk log format:
@@ -28,7 +38,8 @@
 //   block B
 //   block C
 //   ...
-// Log appends are synchronous.
+// A commit queues all of its log (and later home) block writes
+// at once, so the disk sees the whole transaction in flight.
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
@@ -42,14 +53,23 @@ struct log {
   int start;
   int size;
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int closing;     // logd is closing the transaction, please wait.
   int dev;
-  struct logheader lh;
+  struct logheader lh;   // the open transaction.
+
+  // owned by logd: the transaction being committed.
+  struct logheader clh;
+  struct buf *home[LOGSIZE]; // pinned cache bufs of clh's blocks
+  struct buf copy[LOGSIZE];  // their contents when the transaction closed
+
+  uint64 nop;      // FS sys calls completed
+  uint64 ncommit;  // commits written
+  uint64 nblock;   // blocks committed
 };
 struct log log;
 
 static void recover_from_log(void);
-static void commit();
+static void logd(void);
 
 void
 initlog(int dev, struct superblock *sb)
@@ -61,24 +81,37 @@ initlog(int dev, struct superblock *sb)
   log.start = sb->logstart;
   log.size = sb->nlog;
   log.dev = dev;
+  for (int i = 0; i < LOGSIZE; i++) {
+    initsleeplock(&log.copy[i].lock, "logcopy");
+    log.copy[i].dev = dev;
+  }
   recover_from_log();
+  kthread(logd, "logd");
 }
 
-// Copy committed blocks from log to their home location
+// Copy committed blocks from log to their home location,
+// with all of the reads, then all of the writes, in flight at once.
 static void
-install_trans(int recovering)
+install_trans(void)
 {
-  int tail;
-
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    if(recovering == 0)
-      bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
+  struct buf *lbuf[LOGSIZE], *dbuf[LOGSIZE];
+  uint blocks[LOGSIZE];
+  int tail, n = log.lh.n;
+
+  if (n == 0)
+    return;
+  for (tail = 0; tail < n; tail++)
+    blocks[tail] = log.start+tail+1;
+  breadv(log.dev, blocks, lbuf, n); // read log blocks
+  for (tail = 0; tail < n; tail++)
+    blocks[tail] = log.lh.block[tail];
+  breadv(log.dev, blocks, dbuf, n); // read dsts
+  for (tail = 0; tail < n; tail++)
+    memmove(dbuf[tail]->data, lbuf[tail]->data, BSIZE);  // copy block to dst
+  bwritev(dbuf, n);  // write dsts to disk
+  for (tail = 0; tail < n; tail++) {
+    brelse(lbuf[tail]);
+    brelse(dbuf[tail]);
   }
 }
 
@@ -96,18 +129,17 @@ read_head(void)
   brelse(buf);
 }
 
-// Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
+// Write log header lh to disk.
+// This is the true point at which a transaction commits.
 static void
-write_head(void)
+write_head(struct logheader *lh)
 {
   struct buf *buf = bread(log.dev, log.start);
   struct logheader *hb = (struct logheader *) (buf->data);
   int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+  hb->n = lh->n;
+  for (i = 0; i < lh->n; i++) {
+    hb->block[i] = lh->block[i];
   }
   bwrite(buf);
   brelse(buf);
@@ -117,9 +149,9 @@ static void
 recover_from_log(void)
 {
   read_head();
-  install_trans(1); // if committed, copy from log to disk
+  install_trans(); // if committed, copy from log to disk
   log.lh.n = 0;
-  write_head(); // clear the log
+  write_head(&log.lh); // clear the log
 }
 
 // called at the start of each FS system call.
@@ -128,10 +160,11 @@ begin_op(void)
 {
   acquire(&log.lock);
   while(1){
-    if(log.committing){
+    if(log.closing){
       sleep(&log, &log.lock);
     } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
-      // this op might exhaust log space; wait for commit.
+      // this op might exhaust log space; wait for logd
+      // to close the transaction.
       sleep(&log, &log.lock);
     } else {
       log.outstanding += 1;
@@ -142,69 +175,105 @@ begin_op(void)
 }
 
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// logd will commit the system call's updates.
 void
 end_op(void)
 {
-  int do_commit = 0;
-
   acquire(&log.lock);
   log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
-  if(log.outstanding == 0){
-    do_commit = 1;
-    log.committing = 1;
-  } else {
-    // begin_op() may be waiting for log space,
-    // and decrementing log.outstanding has decreased
-    // the amount of reserved space.
-    wakeup(&log);
-  }
+  log.nop++;
+  // logd may be waiting for work or for the transaction
+  // to quiesce, and begin_op() may be waiting for log space,
+  // since decrementing log.outstanding has decreased the
+  // amount of reserved space.
+  wakeup(&log);
   release(&log.lock);
+}
 
-  if(do_commit){
-    // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
-    commit();
-    acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
-    release(&log.lock);
+// Close the open transaction: wait for the FS sys calls in it
+// to finish, then copy its blocks so that new sys calls can
+// modify the cached blocks while logd commits the copies.
+static void
+close_trans(void)
+{
+  int i;
+
+  acquire(&log.lock);
+  while(log.lh.n == 0)
+    sleep(&log, &log.lock);
+  log.closing = 1;
+  while(log.outstanding > 0)
+    sleep(&log, &log.lock);
+  log.clh = log.lh;
+  log.lh.n = 0;
+  release(&log.lock);
+
+  // no sys call can be modifying the blocks now, and they
+  // are pinned, so bread() finds them in the cache.
+  for (i = 0; i < log.clh.n; i++) {
+    struct buf *b = bread(log.dev, log.clh.block[i]);
+    acquiresleep(&log.copy[i].lock);
+    memmove(log.copy[i].data, b->data, BSIZE);
+    log.home[i] = b;
+    brelse(b);
   }
+
+  acquire(&log.lock);
+  log.closing = 0;
+  wakeup(&log);
+  release(&log.lock);
 }
 
-// Copy modified blocks from cache to log.
+// Write the closed transaction to the log, commit it, and
+// install it at the home locations. The copies are written
+// twice, first as log blocks and then as home blocks, so
+// they never pass through the buffer cache.
 static void
-write_log(void)
+commit(void)
 {
-  int tail;
-
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
+  struct buf *bp[LOGSIZE];
+  int i, n = log.clh.n;
+
+  for (i = 0; i < n; i++) {
+    bp[i] = &log.copy[i];
+    bp[i]->blockno = log.start+i+1;
   }
+  bwritev(bp, n);         // Write the copies to the log
+  write_head(&log.clh);   // Write header to disk -- the real commit
+  for (i = 0; i < n; i++)
+    bp[i]->blockno = log.clh.block[i];
+  bwritev(bp, n);         // Now install writes to home locations
+  for (i = 0; i < n; i++) {
+    // the home location is up to date, so the
+    // cache may evict the block (unless the open
+    // transaction has pinned it too).
+    bunpin(log.home[i]);
+    releasesleep(&log.copy[i].lock);
+  }
+  log.clh.n = 0;
+  write_head(&log.clh);   // Erase the transaction from the log
+
+  acquire(&log.lock);
+  log.ncommit++;
+  log.nblock += n;
+  release(&log.lock);
 }
 
+// The log thread: commit transactions one after another.
+// Sys calls that finish while a commit is being written
+// all go into the next one.
 static void
-commit()
+logd(void)
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(0); // Now install writes to home locations
-    log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+  for(;;){
+    close_trans();
+    commit();
   }
 }
 
 // Caller has modified b->data and is done with the buffer.
 // Record the block number and pin in the cache by increasing refcnt.
-// commit()/write_log() will do the disk write.
+// logd will do the disk write.
 //
 // log_write() replaces bwrite(); a typical use is:
 //   bp = bread(...)
@@ -234,3 +303,10 @@ log_write(struct buf *b)
   release(&log.lock);
 }
 
+// Report log counters for the statistics device.
+int
+logstats(char *buf, int sz)
+{
+  return snprintf(buf, sz, "log: ops %ld commits %ld blocks %ld\n",
+                  log.nop, log.ncommit, log.nblock);
+}
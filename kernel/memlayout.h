@@ -25,8 +25,13 @@
 #define VIRTIO0 0x10001000
 #define VIRTIO0_IRQ 1
 
-// core local interruptor (CLINT), which contains the timer.
+// core local interruptor (CLINT), which contains the timer
+// and the machine-mode software interrupt (IPI) bits.
 #define CLINT 0x2000000L
+#define CLINT_MSIP(hartid) (CLINT + 4*(hartid))
+
+// uint64s in each CPU's machine-mode scratch area; see start.c.
+#define TSCRATCH 7
 #define CLINT_MTIMECMP(hartid) (CLINT + 0x4000 + 8*(hartid))
 #define CLINT_MTIME (CLINT + 0xBFF8) // cycles since boot.
 
@@ -62,6 +67,12 @@
 //   fixed-size stack
 //   expandable heap
 //   ...
+//   trapframes of threads created by clone()
 //   TRAPFRAME (p->trapframe, used by the trampoline)
 //   TRAMPOLINE (the same page as in the kernel)
 #define TRAPFRAME (TRAMPOLINE - PGSIZE)
+
+// threads share their creator's page table, so each maps its
+// trapframe at its own address, chosen by its slot in proc[].
+#define THREADFRAME(i) (TRAPFRAME - ((i)+1)*PGSIZE)
+#define USERTOP THREADFRAME(NPROC)  // user memory ends below here
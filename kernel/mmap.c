@@ -0,0 +1,557 @@
+//
+// Memory-mapped files: mmap() and munmap().
+//
+// Each address space has a table of vmas, the regions that
+// mmap() has mapped and the program segments that exec() has
+// loaded, shared by the threads that share its page table.
+// They are only recorded; vmfault() calls mmapfault() to read
+// each page from the file when it is first touched.
+// A MAP_PRIVATE region maps pages from the page cache, read-only
+// or copy-on-write, when whole file pages fit; otherwise, and
+// after fork(), its pages are private copy-on-write copies.
+// A MAP_SHARED region maps the page cache's own pages, so all
+// of a file's mappers, and read() and write(), share one copy.
+// They start out read-only, and the first store marks them
+// dirty (PTE_D) and writable; munmap() and exit() write the
+// dirty pages back through the log.
+//
+// vt->lock protects a table's vmas. mmap() and munmap() also
+// mark the table busy, one at a time, so that munmap() can
+// drop regions from the table, wait for the mmapfault()s that
+// were reading their files, and only then unmap the pages.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "fcntl.h"
+#include "defs.h"
+
+// Allocate an empty table of regions, or return 0.
+struct vmtab*
+vmtaballoc(void)
+{
+  struct vmtab *vt;
+
+  if(sizeof(struct vmtab) > PGSIZE)
+    panic("vmtaballoc");
+  if((vt = (struct vmtab*)kalloc()) == 0)
+    return 0;
+  memset(vt, 0, sizeof(*vt));
+  initlock(&vt->lock, "vmtab");
+  vt->ref = 1;
+  return vt;
+}
+
+// Return vt's vma that holds va, or 0.
+// Caller must hold vt->lock.
+struct vma*
+vmalookup(struct vmtab *vt, uint64 va)
+{
+  struct vma *v;
+
+  for(v = vt->vma; v < &vt->vma[NVMA]; v++)
+    if(v->start <= va && va < v->end)
+      return v;
+  return 0;
+}
+
+// Does any of p's vmas overlap [start, end)?
+// Caller must hold p->vmtab->lock.
+int
+vmaoverlap(struct proc *p, uint64 start, uint64 end)
+{
+  struct vma *v;
+
+  for(v = p->vmtab->vma; v < &p->vmtab->vma[NVMA]; v++)
+    if(v->end && start < v->end && v->start < end)
+      return 1;
+  return 0;
+}
+
+// Wait for other threads' mmap() or munmap() to finish,
+// and mark vt busy with this one.
+static void
+vtbegin(struct vmtab *vt)
+{
+  acquire(&vt->lock);
+  while(vt->busy)
+    sleep(vt, &vt->lock);
+  vt->busy = 1;
+  release(&vt->lock);
+}
+
+static void
+vtend(struct vmtab *vt)
+{
+  acquire(&vt->lock);
+  vt->busy = 0;
+  wakeup(vt);
+  release(&vt->lock);
+}
+
+// PTE bits for a page of v. a MAP_SHARED page only
+// gets PTE_W once it is stored to.
+static int
+vmaperm(struct vma *v)
+{
+  int perm = PTE_U;
+
+  if(v->prot & (PROT_READ|PROT_WRITE))
+    perm |= PTE_R;
+  if((v->prot & PROT_WRITE) && (v->flags & MAP_PRIVATE))
+    perm |= PTE_W;
+  if(v->prot & PROT_EXEC)
+    perm |= PTE_X;
+  return perm;
+}
+
+// Handle a fault on va in one of the current process's vmas,
+// for access as in vmfault(): find the page in the page cache
+// or read it from the file, and map it, or, for a store to a
+// clean MAP_SHARED page, mark it dirty and writable.
+// Returns the physical address of the page, or 0 if va is in no
+// vma, the vma does not allow the access, or there is no memory.
+uint64
+mmapfault(pagetable_t pagetable, uint64 va, int access)
+{
+  struct vmtab *vt = myproc()->vmtab;
+  struct vma *v;
+  struct inode *ip;
+  pte_t *pte;
+  char *mem;
+  int perm, r, cached, flags, locked, raced;
+  int write = access == VMWRITE;
+  uint64 pa;
+  uint off, n;
+
+  // reading the file may sleep, which a caller holding a
+  // spinlock must not do; its copyin() or copyout() fails.
+  push_off();
+  locked = mycpu()->noff > 1;
+  pop_off();
+
+  va = PGROUNDDOWN(va);
+  acquire(&vt->lock);
+  if((v = vmalookup(vt, va)) == 0)
+    goto bad;
+  if((v->prot & (PROT_READ|PROT_WRITE|PROT_EXEC)) == 0)
+    goto bad;
+  if(write && (v->prot & PROT_WRITE) == 0)
+    goto bad;
+  if(access == VMEXEC && (v->prot & PROT_EXEC) == 0)
+    goto bad;
+
+  if((pte = walk(pagetable, va, 0)) != 0 && (*pte & PTE_V)){
+    if(access == VMEXEC && (*pte & PTE_X) == 0)
+      goto bad;
+    if(write && (*pte & PTE_W) == 0){
+      if((v->flags & MAP_SHARED) == 0)
+        goto bad;
+      *pte |= PTE_W | PTE_D;
+    }
+    pa = PTE2PA(*pte);
+    release(&vt->lock);
+    return pa;
+  }
+  if(locked)
+    goto bad;
+
+  ip = v->ip;
+  flags = v->flags;
+  off = v->off + (va - v->start);
+  n = 0;
+  if(va - v->start < v->flen)
+    n = v->flen - (va - v->start);
+  if(n > PGSIZE)
+    n = PGSIZE;
+  perm = vmaperm(v);
+  cached = (flags & MAP_PRIVATE) && off % PGSIZE == 0 && n == PGSIZE;
+  // munmap() waits for this read before it drops v's
+  // reference to ip, or unmaps the page.
+  vt->nfault++;
+  release(&vt->lock);
+
+  r = 0;
+  ilock(ip);
+  if(flags & MAP_SHARED){
+    // the page cache's copy itself, for every mapper.
+    mem = pcacheget(ip, off / PGSIZE, 1);
+  } else if(cached){
+    // share the page cache's copy, until a store.
+    mem = pcacheget(ip, off / PGSIZE, 0);
+    if(perm & PTE_W)
+      perm = (perm & ~PTE_W) | PTE_COW;
+  } else if((mem = kalloc()) != 0){
+    memset(mem, 0, PGSIZE);
+    r = n ? readi(ip, 0, (uint64)mem, off, n) : 0;
+  }
+  iunlock(ip);
+
+  acquire(&vt->lock);
+  // a thread sharing the page table may have mapped
+  // the page while this one was reading it.
+  raced = (pte = walk(pagetable, va, 0)) != 0 && (*pte & PTE_V);
+  if(mem && r >= 0 && !raced){
+    if(write && (flags & MAP_SHARED))
+      perm |= PTE_W | PTE_D;
+    if(mappages(pagetable, va, PGSIZE, (uint64)mem, perm) != 0)
+      r = -1;
+  }
+  if(--vt->nfault == 0)
+    wakeup(&vt->nfault);
+  release(&vt->lock);
+
+  if(mem == 0 || r < 0 || raced){
+    if(mem)
+      kfree(mem);
+    return raced ? vmfault(pagetable, va, myproc()->sz, access) : 0;
+  }
+  if(write && (perm & PTE_COW))
+    return vmfault(pagetable, va, myproc()->sz, access);
+  return (uint64)mem;
+
+ bad:
+  release(&vt->lock);
+  return 0;
+}
+
+// Fault in the file-backed pages of [va, va+n) before the
+// caller takes a lock under which mmapfault() could not run:
+// a spinlock, since reading the file may sleep, or the lock of
+// the mapped file's own inode. Only a head start; the copy
+// that follows still checks every page, and under a spinlock
+// fails on any page that is not mapped by then. Making a page
+// that is already mapped writable reads no file, so a caller
+// that only reads the buffer, or whose copyout() may store
+// fewer bytes than n, can pass VMREAD for access.
+void
+mmapprefault(uint64 va, uint64 n, int access)
+{
+  struct proc *p = myproc();
+  struct vmtab *vt = p->vmtab;
+  uint64 a, start, end;
+  int i;
+
+  for(i = 0; i < NVMA; i++){
+    acquire(&vt->lock);
+    start = vt->vma[i].start;
+    end = vt->vma[i].end;
+    release(&vt->lock);
+    if(end == 0 || va + n <= start || end <= va)
+      continue;
+    a = PGROUNDDOWN(va > start ? va : start);
+    if(va + n < end)
+      end = va + n;
+    for(; a < end; a += PGSIZE)
+      vmfault(p->pagetable, a, p->sz, access);
+  }
+}
+
+// Write the page at pa back to file offset off, without
+// making the file longer. Writes a few blocks per transaction,
+// as filewrite() does.
+static void
+writeback(struct inode *ip, char *pa, uint off)
+{
+  int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+  uint i, n;
+
+  for(i = 0; i < PGSIZE; i += n){
+    begin_op();
+    ilock(ip);
+    n = 0;
+    if(off + i < ip->size){
+      n = ip->size - (off + i);
+      if(n > PGSIZE - i)
+        n = PGSIZE - i;
+      if(n > max)
+        n = max;
+      writei(ip, 0, (uint64)pa + i, off + i, n);
+    }
+    iunlock(ip);
+    end_op();
+    if(n == 0)
+      break;
+  }
+}
+
+// Unmap the pages of v in [start, end) from p's page table,
+// writing dirty MAP_SHARED pages back to the file. A page is
+// written back after it is unmapped, and so after the last
+// store any thread can make to it.
+static void
+vmaunmap(struct proc *p, struct vma *v, uint64 start, uint64 end)
+{
+  uint64 a, pa;
+  pte_t *pte;
+  int dirty;
+
+  for(a = start; a < end; a += PGSIZE){
+    if((pte = walk(p->pagetable, a, 0)) == 0 || (*pte & PTE_V) == 0)
+      continue;
+    pa = PTE2PA(*pte);
+    dirty = (v->flags & MAP_SHARED) && (*pte & PTE_D);
+    kdup((void*)pa);
+    uvmunmap(p->pagetable, a, 1, 1);
+    if(dirty)
+      writeback(v->ip, (char*)pa, v->off + (a - v->start));
+    kfree((void*)pa);
+  }
+}
+
+// Move the start of v up to va, which is in v.
+static void
+vmatrim(struct vma *v, uint64 va)
+{
+  uint64 n = va - v->start;
+
+  v->off += n;
+  v->flen = v->flen > n ? v->flen - n : 0;
+  v->start = va;
+}
+
+// Drop v, whose pages are already unmapped.
+static void
+vmafree(struct vma *v)
+{
+  begin_op();
+  iput(v->ip);
+  end_op();
+  v->ip = 0;
+  v->start = v->end = 0;
+}
+
+// Map len bytes of f, from offset off, into the current
+// process, below USERTOP and any regions already mapped there.
+// Returns the address of the region, or -1.
+uint64
+mmap(uint64 len, int prot, int flags, struct file *f, uint off)
+{
+  struct proc *p = myproc();
+  struct vmtab *vt = p->vmtab;
+  struct vma *v, *nv;
+  uint64 va;
+  int i;
+
+  if(len == 0 || len > USERTOP || off % PGSIZE != 0)
+    return -1;
+  if(f->type != FD_INODE || f->readable == 0)
+    return -1;
+  if(flags != MAP_SHARED && flags != MAP_PRIVATE)
+    return -1;
+  if((prot & PROT_WRITE) && flags == MAP_SHARED && f->writable == 0)
+    return -1;
+
+  // munmap() may still be unmapping a range
+  // that looks free in the table.
+  vtbegin(vt);
+  acquire(&vt->lock);
+  nv = 0;
+  for(v = vt->vma; v < &vt->vma[NVMA]; v++)
+    if(v->end == 0){
+      nv = v;
+      break;
+    }
+  if(nv == 0)
+    goto bad;
+
+  len = PGROUNDUP(len);
+  va = USERTOP - len;
+  for(i = 0; i < NVMA; i++){
+    v = &vt->vma[i];
+    if(v->end && va < v->end && v->start < va + len){
+      if(v->start < len)
+        goto bad;
+      va = v->start - len;
+      i = -1;  // check the new place against every region
+    }
+  }
+  if(va < PGROUNDUP(p->sz))
+    goto bad;
+
+  nv->start = va;
+  nv->end = va + len;
+  nv->prot = prot;
+  nv->flags = flags;
+  nv->off = off;
+  nv->flen = len;
+  nv->ip = idup(f->ip);
+  release(&vt->lock);
+  vtend(vt);
+  return va;
+
+ bad:
+  release(&vt->lock);
+  vtend(vt);
+  return -1;
+}
+
+// Unmap [addr, addr+len) from the current process, which may
+// cover all or part of any number of regions.
+// Returns 0, or -1 if addr is not page-aligned or a region
+// would need splitting and there is no free vma for it.
+int
+munmap(uint64 addr, uint64 len)
+{
+  struct proc *p = myproc();
+  struct vmtab *vt = p->vmtab;
+  struct vma *v, *nv, gone[NVMA];
+  uint64 lo, hi, end;
+  int i, ngone, r;
+
+  if(addr % PGSIZE != 0 || addr + len < addr)
+    return -1;
+  end = PGROUNDUP(addr + len);
+
+  // first take the range out of the table, noting
+  // the pieces of regions that were in it.
+  vtbegin(vt);
+  acquire(&vt->lock);
+  r = 0;
+  ngone = 0;
+  for(v = vt->vma; v < &vt->vma[NVMA]; v++){
+    if(v->end == 0 || end <= v->start || v->end <= addr)
+      continue;
+    lo = addr > v->start ? addr : v->start;
+    hi = end < v->end ? end : v->end;
+
+    nv = 0;
+    if(lo > v->start && hi < v->end){
+      // punching a hole: the part above it becomes a new region.
+      for(nv = vt->vma; nv < &vt->vma[NVMA] && nv->end; nv++)
+        ;
+      if(nv == &vt->vma[NVMA]){
+        r = -1;
+        break;
+      }
+    }
+
+    gone[ngone] = *v;
+    vmatrim(&gone[ngone], lo);
+    gone[ngone].end = hi;
+    ngone++;
+
+    if(lo == v->start && hi == v->end){
+      // gone[] takes v's reference to the file.
+      v->ip = 0;
+      v->start = v->end = 0;
+      continue;
+    }
+    idup(v->ip);
+    if(nv){
+      *nv = *v;
+      vmatrim(nv, hi);
+      idup(nv->ip);
+      v->end = lo;
+    } else if(lo == v->start){
+      vmatrim(v, hi);
+    } else {
+      v->end = lo;
+    }
+  }
+
+  // then wait for faults that found the pieces before
+  // they left the table, since they may map pages there.
+  while(vt->nfault > 0)
+    sleep(&vt->nfault, &vt->lock);
+  release(&vt->lock);
+
+  for(i = 0; i < ngone; i++){
+    vmaunmap(p, &gone[i], gone[i].start, gone[i].end);
+    vmafree(&gone[i]);
+  }
+  vtend(vt);
+  return r;
+}
+
+// Give np p's regions, for fork() or, if share is set, for
+// clone(), whose thread shares p's page table and so shares
+// p's table of regions too. fork()'s child gets copies of the
+// regions, and shares the mapped pages: MAP_SHARED ones as
+// they are, and MAP_PRIVATE ones copy-on-write. Pages below
+// p->sz, of program segments, were already shared by uvmcopy().
+// May sleep, so the caller must hold no spinlock.
+// Returns 0, or -1 with nothing copied.
+int
+mmapfork(struct proc *p, struct proc *np, int share)
+{
+  struct vmtab *vt = p->vmtab, *nvt = np->vmtab;
+  struct vma *v;
+  int i, j;
+
+  if(share){
+    // growproc() finds threads by vmtab, and
+    // changes their sz, under vt->lock.
+    kfree((void*)nvt);  // np's own, still empty
+    acquire(&vt->lock);
+    vt->ref++;
+    np->vmtab = vt;
+    np->sz = p->sz;
+    release(&vt->lock);
+    return 0;
+  }
+
+  vtbegin(vt);
+  acquire(&vt->lock);
+  for(i = 0; i < NVMA; i++){
+    v = &vt->vma[i];
+    if(v->end == 0)
+      continue;
+    if(v->start >= p->sz &&
+       uvmcopyrange(p->pagetable, np->pagetable, v->start, v->end,
+                    v->flags & MAP_SHARED) < 0){
+      release(&vt->lock);
+      vtend(vt);
+      for(j = 0; j < i; j++){
+        if(nvt->vma[j].end == 0)
+          continue;
+        if(nvt->vma[j].start >= p->sz)
+          uvmunmap(np->pagetable, nvt->vma[j].start,
+                   (nvt->vma[j].end - nvt->vma[j].start) / PGSIZE, 1);
+        vmafree(&nvt->vma[j]);
+      }
+      return -1;
+    }
+    nvt->vma[i] = *v;
+    idup(v->ip);
+  }
+  release(&vt->lock);
+  vtend(vt);
+  return 0;
+}
+
+// Drop p's reference to its regions, for exit() and exec().
+// The last thread to drop them unmaps them, writing back
+// dirty MAP_SHARED pages, and frees the table.
+void
+munmapall(struct proc *p)
+{
+  struct vmtab *vt = p->vmtab;
+  struct vma *v;
+  int ref;
+
+  if(vt == 0)
+    return;
+  acquire(&vt->lock);
+  p->vmtab = 0;
+  ref = --vt->ref;
+  release(&vt->lock);
+  if(ref > 0)
+    return;
+
+  // no other thread can be using vt now.
+  for(v = vt->vma; v < &vt->vma[NVMA]; v++){
+    if(v->end == 0)
+      continue;
+    vmaunmap(p, v, v->start, v->end);
+    vmafree(v);
+  }
+  kfree((void*)vt);
+}
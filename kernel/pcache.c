@@ -0,0 +1,334 @@
+// Page cache.
+//
+// Holds the data of regular files in whole pages, keyed by
+// (dev, inum, page number in the file), in front of the
+// buffer cache. readi() copies out of cached pages, and a miss
+// reads the page's blocks through bio once. exec() and
+// MAP_PRIVATE mmap() map read-only or copy-on-write references
+// to cached pages, so processes running the same program share
+// one copy of its text. MAP_SHARED mmap() maps the cached
+// pages themselves, writable, so that every process mapping a
+// file, and read() and write(), see one copy of each page.
+//
+// The cache holds one reference (see kdup()) to each of its
+// pages. A page with no other reference is not mapped by any
+// process, and is the kind that a full cache evicts, least
+// recently used first, and that kalloc() takes back when
+// memory runs out.
+//
+// writei() still writes through the buffer cache and the log,
+// and updates the cached copy of an unmapped page in place. A
+// page that only MAP_PRIVATE mappings hold must not change
+// under its processes, so writei() drops it from the cache
+// instead, as itrunc() drops all of a file's pages. A page in
+// a MAP_SHARED mapping stays, and changes in place.
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "riscv.h"
+#include "fs.h"
+#include "file.h"
+#include "defs.h"
+
+#define NPCHASH 1021
+#define PCHASH(dev, inum, pgno) ((((dev) * 31 + (inum)) * 61 + (pgno)) % NPCHASH)
+#define PCMEMFRAC 2   // cache at most 1/PCMEMFRAC of free memory
+
+struct cpage {
+  uint dev;
+  uint inum;
+  uint pgno;              // page number in the file
+  char *pa;               // the page
+  int shared;             // in a MAP_SHARED mapping
+  struct cpage *next;     // hash chain, or free list
+  struct cpage *lrunext;  // LRU list, least recently used first
+  struct cpage *lruprev;
+};
+
+struct {
+  struct spinlock lock;
+  struct cpage *hash[NPCHASH];
+  struct cpage *free;
+  struct cpage lru;       // LRU list sentinel
+  int npage;              // pages in the cache
+  int max;                // most pages the cache will hold
+  uint64 nhit;
+  uint64 nmiss;
+  uint64 nevict;
+  uint64 ninval;
+  uint64 nreclaim;
+} pcache;
+
+// Set aside entries for 1/PCMEMFRAC of free memory.
+// The pages themselves are allocated as files are read.
+void
+pcacheinit(void)
+{
+  struct cpage *c;
+  char *pg;
+  int i, j, n, npage;
+
+  initlock(&pcache.lock, "pcache");
+  pcache.lru.lrunext = pcache.lru.lruprev = &pcache.lru;
+
+  n = PGSIZE / sizeof(struct cpage);
+  npage = (kfreepages() / PCMEMFRAC + n - 1) / n;
+  for(i = 0; i < npage; i++){
+    if((pg = kalloc()) == 0)
+      panic("pcacheinit");
+    for(j = 0; j < n; j++){
+      c = (struct cpage*)pg + j;
+      c->next = pcache.free;
+      pcache.free = c;
+      pcache.max++;
+    }
+  }
+}
+
+// Caller must hold pcache.lock.
+static struct cpage*
+pclookup(uint dev, uint inum, uint pgno)
+{
+  struct cpage *c;
+
+  for(c = pcache.hash[PCHASH(dev, inum, pgno)]; c; c = c->next)
+    if(c->dev == dev && c->inum == inum && c->pgno == pgno)
+      return c;
+  return 0;
+}
+
+// Caller must hold pcache.lock.
+static void
+lruremove(struct cpage *c)
+{
+  c->lruprev->lrunext = c->lrunext;
+  c->lrunext->lruprev = c->lruprev;
+}
+
+// Caller must hold pcache.lock.
+static void
+lruappend(struct cpage *c)
+{
+  c->lruprev = pcache.lru.lruprev;
+  c->lrunext = &pcache.lru;
+  c->lruprev->lrunext = c;
+  pcache.lru.lruprev = c;
+}
+
+// Take c out of the cache and drop the cache's
+// reference to its page. Caller must hold pcache.lock.
+static void
+pcremove(struct cpage *c)
+{
+  struct cpage **cp;
+
+  for(cp = &pcache.hash[PCHASH(c->dev, c->inum, c->pgno)]; *cp != c; cp = &(*cp)->next)
+    ;
+  *cp = c->next;
+  lruremove(c);
+  kfree(c->pa);
+  c->pa = 0;
+  c->next = pcache.free;
+  pcache.free = c;
+  pcache.npage--;
+}
+
+// Return a free entry, evicting the least recently used
+// page that nobody has mapped if the cache is full, or 0.
+// Caller must hold pcache.lock.
+static struct cpage*
+pcalloc(void)
+{
+  struct cpage *c;
+
+  if(pcache.free == 0){
+    for(c = pcache.lru.lrunext; c != &pcache.lru; c = c->lrunext){
+      if(krefcnt(c->pa) == 1){
+        pcremove(c);
+        pcache.nevict++;
+        break;
+      }
+    }
+  }
+  if((c = pcache.free) != 0)
+    pcache.free = c->next;
+  return c;
+}
+
+// Return page pgno of ip's contents, with a reference for the
+// caller to map or kfree(), reading it from the file if it is
+// not cached. Bytes past the end of the file are zero.
+// If shared is set, the caller maps the page MAP_SHARED, and
+// the page must stay in the cache while it is mapped.
+// Returns 0 if there is no memory, or, if shared is set, no
+// room in the cache.
+// Caller must hold ip->lock.
+char*
+pcacheget(struct inode *ip, uint pgno, int shared)
+{
+  struct cpage *c;
+  char *pa;
+  uint off, n;
+
+  acquire(&pcache.lock);
+  if((c = pclookup(ip->dev, ip->inum, pgno)) != 0){
+    pcache.nhit++;
+    lruremove(c);
+    lruappend(c);
+    if(krefcnt(c->pa) == 1)
+      c->shared = 0;  // no longer mapped
+    c->shared |= shared;
+    kdup(c->pa);
+    release(&pcache.lock);
+    return c->pa;
+  }
+  pcache.nmiss++;
+  release(&pcache.lock);
+
+  if((pa = kalloc()) == 0)
+    return 0;
+  memset(pa, 0, PGSIZE);
+  off = pgno * PGSIZE;
+  if(off < ip->size){
+    n = ip->size - off < PGSIZE ? ip->size - off : PGSIZE;
+    if(readblocks(ip, 0, (uint64)pa, off, n) < 0){
+      kfree(pa);
+      return 0;
+    }
+  }
+
+  // nobody else can have cached the page meanwhile,
+  // since that also takes ip->lock.
+  acquire(&pcache.lock);
+  if((c = pcalloc()) != 0){
+    c->dev = ip->dev;
+    c->inum = ip->inum;
+    c->pgno = pgno;
+    c->pa = pa;
+    c->shared = shared;
+    c->next = pcache.hash[PCHASH(ip->dev, ip->inum, pgno)];
+    pcache.hash[PCHASH(ip->dev, ip->inum, pgno)] = c;
+    lruappend(c);
+    pcache.npage++;
+    kdup(pa);
+  } else if(shared){
+    kfree(pa);
+    pa = 0;
+  }
+  release(&pcache.lock);
+  return pa;
+}
+
+// Copy n bytes of ip at off, which the caller has checked
+// are in the file, to user_dst/dst a page at a time.
+// Returns the number of bytes copied, or -1.
+// Caller must hold ip->lock.
+int
+pcacheread(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
+{
+  uint tot, m;
+  char *pa;
+  int r;
+
+  for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
+    // without memory for the page, read around the cache.
+    if((pa = pcacheget(ip, off / PGSIZE, 0)) == 0){
+      if((r = readblocks(ip, user_dst, dst, off, n - tot)) < 0)
+        return -1;
+      return tot + r;
+    }
+    m = PGSIZE - off % PGSIZE;
+    if(m > n - tot)
+      m = n - tot;
+    r = either_copyout(user_dst, dst, pa + off % PGSIZE, m);
+    kfree(pa);
+    if(r == -1)
+      return -1;
+  }
+  return tot;
+}
+
+// writei() has written the n bytes at src to ip at off,
+// all in one block. Bring the cached page up to date, or
+// drop it if only MAP_PRIVATE mappings have it. src may be
+// in the page itself, for a MAP_SHARED page's writeback.
+// Caller must hold ip->lock.
+void
+pcachewrite(struct inode *ip, uint off, char *src, uint n)
+{
+  struct cpage *c;
+
+  acquire(&pcache.lock);
+  if((c = pclookup(ip->dev, ip->inum, off / PGSIZE)) != 0){
+    if(c->shared || krefcnt(c->pa) == 1){
+      memmove(c->pa + off % PGSIZE, src, n);
+    } else {
+      pcremove(c);
+      pcache.ninval++;
+    }
+  }
+  release(&pcache.lock);
+}
+
+// Drop the cached pages of ip that hold any of the
+// n bytes at off, which are about to change. Pages in
+// MAP_SHARED mappings stay, with those bytes zeroed.
+// Caller must hold ip->lock.
+void
+pcacheinval(struct inode *ip, uint off, uint n)
+{
+  struct cpage *c;
+  uint pg, a, b;
+
+  if(n == 0)
+    return;
+  acquire(&pcache.lock);
+  if(pcache.npage > 0){
+    for(pg = off / PGSIZE; pg <= (off + n - 1) / PGSIZE; pg++){
+      if((c = pclookup(ip->dev, ip->inum, pg)) == 0)
+        continue;
+      if(c->shared && krefcnt(c->pa) > 1){
+        a = off > pg * PGSIZE ? off - pg * PGSIZE : 0;
+        b = off + n < (pg + 1) * PGSIZE ? off + n - pg * PGSIZE : PGSIZE;
+        memset(c->pa + a, 0, b - a);
+      } else {
+        pcremove(c);
+        pcache.ninval++;
+      }
+    }
+  }
+  release(&pcache.lock);
+}
+
+// kalloc() has run out of memory: free up to n pages that
+// no process has mapped, least recently used first.
+// Returns the number of pages freed.
+int
+pcachereclaim(int n)
+{
+  struct cpage *c, *next;
+  int freed = 0;
+
+  acquire(&pcache.lock);
+  for(c = pcache.lru.lrunext; c != &pcache.lru && freed < n; c = next){
+    next = c->lrunext;
+    if(krefcnt(c->pa) == 1){
+      pcremove(c);
+      pcache.nreclaim++;
+      freed++;
+    }
+  }
+  release(&pcache.lock);
+  return freed;
+}
+
+// Report page cache counters for the statistics device.
+int
+pcachestats(char *buf, int sz)
+{
+  return snprintf(buf, sz, "pcache: pages %d max %d hit %ld miss %ld evict %ld inval %ld reclaim %ld\n",
+                  pcache.npage, pcache.max, pcache.nhit, pcache.nmiss,
+                  pcache.nevict, pcache.ninval, pcache.nreclaim);
+}
@@ -8,17 +8,50 @@
 #include "sleeplock.h"
 #include "file.h"
 
-#define PIPESIZE 512
+#include "fcntl.h"
+
+// The pipe's ring starts out in the pipe's own page. A pipe
+// whose writer keeps finding the ring full is making the two
+// sides take turns a ring at a time, so its ring grows, by
+// doubling, up to pi->max. fcntl(F_SETPIPE_SZ) sets the size.
+//
+// splice() and tee() copy between the ring and a file or
+// another pipe without holding pi->lock, since reading or
+// writing the file may sleep. Instead they mark the end of the
+// ring they are using busy, which keeps other readers (rbusy)
+// or writers (wbusy) out of that end, and keeps the ring from
+// being resized, until they are done.
+#define PIPESIZE 2048         // initial ring
+#define PIPEGROW (4*PGSIZE)   // default pi->max
+#define PIPEMAX  (16*PGSIZE)  // largest ring F_SETPIPE_SZ allows
+#define PIPEFULL 4            // grow after finding the ring full this often
 
 struct pipe {
   struct spinlock lock;
-  char data[PIPESIZE];
+  char *data;     // the ring: buf, or a kalloc_pages() block
+  uint size;      // bytes in the ring, a power of two
+  uint max;       // grow the ring up to this size
+  uint nfull;     // writes that found the ring full since it last grew
   uint nread;     // number of bytes read
   uint nwrite;    // number of bytes written
   int readopen;   // read fd is still open
   int writeopen;  // write fd is still open
+  int rbusy;      // a splice is copying out of the ring
+  int wbusy;      // a splice is copying into the ring
+  char buf[PIPESIZE];
 };
 
+// buddy order of a ring of size bytes.
+static int
+ringorder(uint size)
+{
+  int k;
+
+  for(k = 0; ((uint)PGSIZE << k) < size; k++)
+    ;
+  return k;
+}
+
 int
 pipealloc(struct file **f0, struct file **f1)
 {
@@ -34,6 +67,12 @@ pipealloc(struct file **f0, struct file **f1)
   pi->writeopen = 1;
   pi->nwrite = 0;
   pi->nread = 0;
+  pi->data = pi->buf;
+  pi->size = PIPESIZE;
+  pi->max = PIPEGROW;
+  pi->nfull = 0;
+  pi->rbusy = 0;
+  pi->wbusy = 0;
   initlock(&pi->lock, "pipe");
   (*f0)->type = FD_PIPE;
   (*f0)->readable = 1;
@@ -55,6 +94,43 @@ pipealloc(struct file **f0, struct file **f1)
   return -1;
 }
 
+// Move the unread bytes into a ring of size bytes, a power
+// of two no smaller than PIPESIZE. Returns -1 if they do not
+// fit or there is no memory. Caller must hold pi->lock.
+static int
+piperesize(struct pipe *pi, uint size)
+{
+  char *data;
+  uint n, off, m;
+
+  n = pi->nwrite - pi->nread;
+  if(n > size)
+    return -1;
+  if(size == pi->size)
+    return 0;
+  if(size == PIPESIZE)
+    data = pi->buf;
+  else if((data = kalloc_pages(ringorder(size))) == 0)
+    return -1;
+
+  // the unread bytes may wrap around the end of the old ring.
+  off = pi->nread & (pi->size - 1);
+  m = pi->size - off;
+  if(m > n)
+    m = n;
+  memmove(data, pi->data + off, m);
+  memmove(data + m, pi->data, n - m);
+
+  if(pi->data != pi->buf)
+    kfree_pages(pi->data, ringorder(pi->size));
+  pi->data = data;
+  pi->size = size;
+  pi->nread = 0;
+  pi->nwrite = n;
+  pi->nfull = 0;
+  return 0;
+}
+
 void
 pipeclose(struct pipe *pi, int writable)
 {
@@ -68,15 +144,20 @@ pipeclose(struct pipe *pi, int writable)
   }
   if(pi->readopen == 0 && pi->writeopen == 0){
     release(&pi->lock);
+    if(pi->data != pi->buf)
+      kfree_pages(pi->data, ringorder(pi->size));
     kfree((char*)pi);
   } else
     release(&pi->lock);
 }
 
+// Copy user data into the ring a contiguous run at a time,
+// so each copyin() walks the page table once per page.
 int
 pipewrite(struct pipe *pi, uint64 addr, int n)
 {
   int i = 0;
+  uint off, m;
   struct proc *pr = myproc();
 
   acquire(&pi->lock);
@@ -85,15 +166,25 @@ pipewrite(struct pipe *pi, uint64 addr, int n)
       release(&pi->lock);
       return -1;
     }
-    if(pi->nwrite == pi->nread + PIPESIZE){ //DOC: pipewrite-full
+    if(pi->wbusy){
+      sleep(&pi->nwrite, &pi->lock);
+    } else if(pi->nwrite == pi->nread + pi->size){ //DOC: pipewrite-full
+      if(pi->size < pi->max && !pi->rbusy && ++pi->nfull >= PIPEFULL &&
+         piperesize(pi, pi->size * 2) == 0)
+        continue;
       wakeup(&pi->nread);
       sleep(&pi->nwrite, &pi->lock);
     } else {
-      char ch;
-      if(copyin(pr->pagetable, &ch, addr + i, 1) == -1)
+      off = pi->nwrite & (pi->size - 1);
+      m = pi->size - (pi->nwrite - pi->nread);
+      if(m > pi->size - off)
+        m = pi->size - off;
+      if(m > n - i)
+        m = n - i;
+      if(copyin(pr->pagetable, pi->data + off, addr + i, m) == -1)
         break;
-      pi->data[pi->nwrite++ % PIPESIZE] = ch;
-      i++;
+      pi->nwrite += m;
+      i += m;
     }
   }
   wakeup(&pi->nread);
@@ -106,25 +197,243 @@ int
 piperead(struct pipe *pi, uint64 addr, int n)
 {
   int i;
+  uint off, m;
   struct proc *pr = myproc();
-  char ch;
 
   acquire(&pi->lock);
-  while(pi->nread == pi->nwrite && pi->writeopen){  //DOC: pipe-empty
+  while((pi->nread == pi->nwrite && pi->writeopen) || pi->rbusy){  //DOC: pipe-empty
     if(pr->killed){
       release(&pi->lock);
       return -1;
     }
     sleep(&pi->nread, &pi->lock); //DOC: piperead-sleep
   }
-  for(i = 0; i < n; i++){  //DOC: piperead-copy
-    if(pi->nread == pi->nwrite)
-      break;
-    ch = pi->data[pi->nread++ % PIPESIZE];
-    if(copyout(pr->pagetable, addr + i, &ch, 1) == -1)
+  for(i = 0; i < n && pi->nread != pi->nwrite; i += m){  //DOC: piperead-copy
+    off = pi->nread & (pi->size - 1);
+    m = pi->nwrite - pi->nread;
+    if(m > pi->size - off)
+      m = pi->size - off;
+    if(m > n - i)
+      m = n - i;
+    if(copyout(pr->pagetable, addr + i, pi->data + off, m) == -1)
       break;
+    pi->nread += m;
   }
   wakeup(&pi->nwrite);  //DOC: piperead-wakeup
   release(&pi->lock);
   return i;
 }
+
+// fcntl() on either end of a pipe. F_SETPIPE_SZ rounds the
+// size up to a power of two and fixes the ring at that size.
+// Returns the ring's size, or -1.
+int
+pipefcntl(struct pipe *pi, int cmd, int arg)
+{
+  uint size;
+
+  if(cmd == F_GETPIPE_SZ)
+    return pi->size;
+  if(cmd != F_SETPIPE_SZ || arg < 0 || arg > PIPEMAX)
+    return -1;
+
+  for(size = PIPESIZE; size < arg; size *= 2)
+    ;
+  acquire(&pi->lock);
+  while(pi->rbusy || pi->wbusy)
+    sleep(&pi->nwrite, &pi->lock);
+  if(piperesize(pi, size) < 0){
+    release(&pi->lock);
+    return -1;
+  }
+  pi->max = size;
+  wakeup(&pi->nwrite);
+  release(&pi->lock);
+  return size;
+}
+
+// Does the ring have room, with no splice writing to it?
+// Caller must hold pi->lock.
+static int
+wready(struct pipe *pi)
+{
+  return !pi->wbusy && pi->nwrite != pi->nread + pi->size;
+}
+
+// Wait until the ring has room and no splice is writing
+// to it, then mark it wbusy. Returns the length of the free
+// run at nwrite, at most n, and its offset in *off, or -1 if
+// the pipe has no reader. Caller must hold pi->lock.
+static int
+wbegin(struct pipe *pi, int n, uint *off)
+{
+  uint m;
+
+  while(!wready(pi)){
+    if(pi->readopen == 0 || myproc()->killed)
+      return -1;
+    wakeup(&pi->nread);
+    sleep(&pi->nwrite, &pi->lock);
+  }
+  if(pi->readopen == 0)
+    return -1;
+  pi->wbusy = 1;
+  *off = pi->nwrite & (pi->size - 1);
+  m = pi->size - (pi->nwrite - pi->nread);
+  if(m > pi->size - *off)
+    m = pi->size - *off;
+  if(m > n)
+    m = n;
+  return m;
+}
+
+// A splice has put n bytes at nwrite. Caller must hold pi->lock.
+static void
+wend(struct pipe *pi, int n)
+{
+  pi->wbusy = 0;
+  if(n > 0)
+    pi->nwrite += n;
+  wakeup(&pi->nread);
+  wakeup(&pi->nwrite);
+}
+
+// Wait until the ring has unread bytes and no splice is reading
+// from it, then mark it rbusy. Returns the length of the unread
+// run at nread, at most n, and its offset in *off; 0 if the
+// pipe is empty and has no writer; or -1 if killed.
+// Caller must hold pi->lock.
+static int
+rbegin(struct pipe *pi, int n, uint *off)
+{
+  uint m;
+
+  while((pi->nread == pi->nwrite && pi->writeopen) || pi->rbusy){
+    if(myproc()->killed)
+      return -1;
+    sleep(&pi->nread, &pi->lock);
+  }
+  if(pi->nread == pi->nwrite)
+    return 0;
+  pi->rbusy = 1;
+  *off = pi->nread & (pi->size - 1);
+  m = pi->nwrite - pi->nread;
+  if(m > pi->size - *off)
+    m = pi->size - *off;
+  if(m > n)
+    m = n;
+  return m;
+}
+
+// A splice has copied n bytes from nread, and consumed
+// them if consume is set. Caller must hold pi->lock.
+static void
+rend(struct pipe *pi, int n, int consume)
+{
+  pi->rbusy = 0;
+  if(consume && n > 0)
+    pi->nread += n;
+  wakeup(&pi->nwrite);
+  wakeup(&pi->nread);
+}
+
+// Move up to n bytes from file f into the pipe. readi()
+// copies them from the buffer cache straight into the ring.
+int
+pipesplicein(struct pipe *pi, struct file *f, int n)
+{
+  uint off;
+  int m, r;
+
+  if(n == 0)
+    return 0;
+  acquire(&pi->lock);
+  m = wbegin(pi, n, &off);
+  release(&pi->lock);
+  if(m < 0)
+    return -1;
+
+  r = fileread(f, 0, (uint64)(pi->data + off), m);
+
+  acquire(&pi->lock);
+  wend(pi, r);
+  release(&pi->lock);
+  return r;
+}
+
+// Move up to n bytes from the pipe into file f. writei()
+// copies them from the ring straight into the buffer cache.
+int
+pipespliceout(struct pipe *pi, struct file *f, int n)
+{
+  uint off;
+  int m, r;
+
+  if(n == 0)
+    return 0;
+  acquire(&pi->lock);
+  m = rbegin(pi, n, &off);
+  release(&pi->lock);
+  if(m <= 0)
+    return m;
+
+  r = filewrite(f, 0, (uint64)(pi->data + off), m);
+
+  acquire(&pi->lock);
+  rend(pi, r, 1);
+  release(&pi->lock);
+  return r;
+}
+
+// Copy up to n bytes from pipe src to pipe dst, consuming
+// them from src if consume is set. Never sleeps while src is
+// rbusy: if dst is full, it gives src back and waits for room
+// first, since a tee from dst to src may need src to drain dst.
+int
+pipetee(struct pipe *src, struct pipe *dst, int n, int consume)
+{
+  uint roff, woff;
+  int m;
+
+  if(src == dst)
+    return -1;
+  if(n == 0)
+    return 0;
+  for(;;){
+    acquire(&src->lock);
+    m = rbegin(src, n, &roff);
+    release(&src->lock);
+    if(m <= 0)
+      return m;
+    acquire(&dst->lock);
+    if(wready(dst) || dst->readopen == 0)
+      break;
+    release(&dst->lock);
+
+    acquire(&src->lock);
+    rend(src, 0, 0);
+    release(&src->lock);
+    acquire(&dst->lock);
+    while(!wready(dst) && dst->readopen && !myproc()->killed){
+      wakeup(&dst->nread);
+      sleep(&dst->nwrite, &dst->lock);
+    }
+    release(&dst->lock);
+    if(myproc()->killed)
+      return -1;
+  }
+  m = wbegin(dst, m, &woff);
+  release(&dst->lock);
+
+  if(m > 0){
+    memmove(dst->data + woff, src->data + roff, m);
+    acquire(&dst->lock);
+    wend(dst, m);
+    release(&dst->lock);
+  }
+
+  acquire(&src->lock);
+  rend(src, m, consume);
+  release(&src->lock);
+  return m;
+}
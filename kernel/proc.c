@@ -5,6 +5,8 @@
 #include "spinlock.h"
 #include "proc.h"
 #include "defs.h"
+#include "fcntl.h"
+#include "futex.h"
 
 struct cpu cpus[NCPU];
 
@@ -15,8 +17,16 @@ struct proc *initproc;
 int nextpid = 1;
 struct spinlock pid_lock;
 
+// Hash from pid to proc, so that kill() need not search
+// proc[]. pid_lock protects the chains as well as nextpid.
+// Lock order: p->lock, then pid_lock.
+#define NPIDHASH 67
+#define PIDHASH(pid) (&pidhash[(pid) % NPIDHASH])
+struct proc *pidhash[NPIDHASH];
+
 extern void forkret(void);
 static void freeproc(struct proc *p);
+static int waitpid(int wpid, uint64 addr);
 
 extern char trampoline[]; // trampoline.S
 
@@ -26,6 +36,69 @@ extern char trampoline[]; // trampoline.S
 // must be acquired before any p->lock.
 struct spinlock wait_lock;
 
+// Per-CPU run queues. A RUNNABLE process is on exactly one
+// queue, that of the CPU that made it runnable, and each
+// CPU's scheduler() runs the processes on its own queue.
+// A CPU whose queue is empty steals from another CPU's queue.
+// So picking the next process costs the same however many
+// processes exist.
+// Lock order: p->lock, then a run queue's lock.
+//
+// Scheduling is a multi-level feedback queue. A queue has
+// NPRIO levels, 0 the highest, and a process waits at level
+// p->prio. scheduler() runs the first process of the highest
+// non-empty level. Each timer tick that a process spends
+// running is charged to it, and after QUANTUM(prio) ticks at
+// a level it moves down one, so CPU-bound processes sink while
+// ones that mostly sleep stay at the top. A tick also preempts
+// the running process if a higher level has work on its CPU.
+// Every BOOSTTICKS ticks all processes go back up to their
+// base level, set by setpriority(), so that none starves.
+#define QUANTUM(prio) (1 << (prio))
+#define BOOSTTICKS 50
+
+struct runq {
+  struct spinlock lock;
+  struct {
+    struct proc *head; // chain through proc.rqnext
+    struct proc *tail;
+  } level[NPRIO];
+  int n;               // processes on the queue
+  uint epoch;          // ticks/BOOSTTICKS when last boosted
+  uint64 nrun;         // processes this CPU has run
+  uint64 nsteal;       // ... taken from another CPU's queue
+} runq[NCPU];
+
+// Wait queues, hashed by channel, so that wakeup(chan) only
+// looks at processes that sleep on channels in chan's queue.
+// A process joins its queue in sleep() and leaves it on the
+// way out of sleep(), so a queue can hold processes that were
+// woken, e.g. by kill(), but have not left yet.
+// Lock order: the sleep() caller's lock, then a wait queue's
+// lock, then p->lock.
+#define NWAITQ 61
+#define WAITQ(chan) (&waitq[((uint64)(chan) >> 3) % NWAITQ])
+
+struct waitq {
+  struct spinlock lock;
+  struct proc *head;   // chain through proc.wqnext
+} waitq[NWAITQ];
+
+// Futexes: sleep and wakeup for user programs, with a key
+// for the user word as the channel. A word in MAP_SHARED
+// memory is keyed by its physical address: every mapping of
+// the file maps the page cache's one copy of the page, so
+// processes sharing the file find each other. A word in private memory
+// can move to a new page at a copy-on-write fault, so its key
+// is its page table and virtual address, which threads share;
+// the top bit keeps these keys apart from kernel addresses.
+// A futex lock, chosen by the key, makes the check of the word
+// and the sleep atomic with respect to FUTEX_WAKE.
+#define NFUTEX 31
+#define FUTEXKEY(pagetable, va) \
+  ((1L << 63) | ((uint64)(pagetable) >> PGSHIFT) * MAXVA | (va))
+struct spinlock futexlock[NFUTEX];
+
 // Allocate a page for each process's kernel stack.
 // Map it high in memory, followed by an invalid
 // guard page.
@@ -50,6 +123,12 @@ procinit(void)
   
   initlock(&pid_lock, "nextpid");
   initlock(&wait_lock, "wait_lock");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&runq[i].lock, "runq");
+  for(int i = 0; i < NWAITQ; i++)
+    initlock(&waitq[i].lock, "waitq");
+  for(int i = 0; i < NFUTEX; i++)
+    initlock(&futexlock[i], "futex");
   for(p = proc; p < &proc[NPROC]; p++) {
       initlock(&p->lock, "proc");
       p->kstack = KSTACK((int) (p - proc));
@@ -97,6 +176,98 @@ allocpid() {
   return pid;
 }
 
+// Move p back up to its base level if there has been
+// a priority boost since it last ran or was queued.
+// Caller must hold p->lock.
+static void
+boost(struct proc *p)
+{
+  uint epoch = ticks / BOOSTTICKS;
+
+  if(p->epoch != epoch){
+    p->epoch = epoch;
+    p->prio = p->base;
+    p->used = 0;
+  }
+}
+
+// Make p RUNNABLE and put it at the tail of its level
+// in this CPU's run queue. If another CPU is idle, send
+// it an IPI so that it can steal p.
+// Caller must hold p->lock.
+static void
+setrunnable(struct proc *p)
+{
+  int id = cpuid();
+  struct runq *rq = &runq[id];
+
+  p->state = RUNNABLE;
+  boost(p);
+  acquire(&rq->lock);
+  p->rqnext = 0;
+  if(rq->level[p->prio].tail)
+    rq->level[p->prio].tail->rqnext = p;
+  else
+    rq->level[p->prio].head = p;
+  rq->level[p->prio].tail = p;
+  rq->n++;
+  release(&rq->lock);
+
+  // pairs with the check of the queues in idle().
+  __sync_synchronize();
+  for(int i = 0; i < NCPU; i++){
+    if(i != id && cpus[i].idle &&
+       __sync_bool_compare_and_swap(&cpus[i].idle, 1, 0)){
+      ipi(i);
+      break;
+    }
+  }
+}
+
+// Take the first process of the highest non-empty level
+// of rq, or return 0 if it is empty. The unlocked peek at
+// rq->n keeps CPUs looking for work off the locks of empty
+// queues. After a priority boost, the lower levels are first
+// appended to level 0; boost() then resets each process's
+// level when it next runs or is queued.
+static struct proc*
+dequeue(struct runq *rq)
+{
+  struct proc *p;
+  uint epoch;
+  int l;
+
+  if(__atomic_load_n(&rq->n, __ATOMIC_RELAXED) == 0)
+    return 0;
+  acquire(&rq->lock);
+  epoch = ticks / BOOSTTICKS;
+  if(rq->epoch != epoch){
+    rq->epoch = epoch;
+    for(l = 1; l < NPRIO; l++){
+      if(rq->level[l].head == 0)
+        continue;
+      if(rq->level[0].tail)
+        rq->level[0].tail->rqnext = rq->level[l].head;
+      else
+        rq->level[0].head = rq->level[l].head;
+      rq->level[0].tail = rq->level[l].tail;
+      rq->level[l].head = rq->level[l].tail = 0;
+    }
+  }
+  p = 0;
+  for(l = 0; l < NPRIO; l++){
+    if((p = rq->level[l].head) != 0){
+      rq->level[l].head = p->rqnext;
+      if(rq->level[l].head == 0)
+        rq->level[l].tail = 0;
+      rq->n--;
+      break;
+    }
+  }
+  release(&rq->lock);
+  return p;
+}
+
 // Look in the process table for an UNUSED proc.
 // If found, initialize state required to run in the kernel,
 // and return with p->lock held.
@@ -120,6 +291,11 @@ found:
   p->pid = allocpid();
   p->state = USED;
 
+  acquire(&pid_lock);
+  p->pidnext = *PIDHASH(p->pid);
+  *PIDHASH(p->pid) = p;
+  release(&pid_lock);
+
   // Allocate a trapframe page.
   if((p->trapframe = (struct trapframe *)kalloc()) == 0){
     freeproc(p);
@@ -128,6 +304,7 @@ found:
   }
 
   // An empty user page table.
+  p->tfva = TRAPFRAME;
   p->pagetable = proc_pagetable(p);
   if(p->pagetable == 0){
     freeproc(p);
@@ -135,6 +312,12 @@ found:
     return 0;
   }
 
+  if((p->vmtab = vmtaballoc()) == 0){
+    freeproc(p);
+    release(&p->lock);
+    return 0;
+  }
+
   // Set up new context to start executing at forkret,
   // which returns to user space.
   memset(&p->context, 0, sizeof(p->context));
@@ -150,19 +333,35 @@ found:
 static void
 freeproc(struct proc *p)
 {
+  struct proc **pp;
+
+  if(p->pid){
+    acquire(&pid_lock);
+    for(pp = PIDHASH(p->pid); *pp != p; pp = &(*pp)->pidnext)
+      ;
+    *pp = p->pidnext;
+    release(&pid_lock);
+  }
   if(p->trapframe)
     kfree((void*)p->trapframe);
   p->trapframe = 0;
   if(p->pagetable)
-    proc_freepagetable(p->pagetable, p->sz);
+    proc_freepagetable(p->pagetable, p->sz, p->tfva);
   p->pagetable = 0;
+  // exit() has given up the vmtab of a process that ran;
+  // this one's is unused, from a failed fork() or clone().
+  if(p->vmtab)
+    kfree((void*)p->vmtab);
+  p->vmtab = 0;
   p->sz = 0;
+  p->kfn = 0;
   p->pid = 0;
   p->parent = 0;
   p->name[0] = 0;
   p->chan = 0;
   p->killed = 0;
   p->xstate = 0;
+  p->base = p->prio = p->used = 0;
   p->state = UNUSED;
 }
 
@@ -199,13 +398,16 @@ proc_pagetable(struct proc *p)
   return pagetable;
 }
 
-// Free a process's page table, and free the
-// physical memory it refers to.
+// Drop a process's reference to its page table, whose
+// trapframe is mapped at tfva. If no other thread shares
+// it, free it and the physical memory it refers to.
 void
-proc_freepagetable(pagetable_t pagetable, uint64 sz)
+proc_freepagetable(pagetable_t pagetable, uint64 sz, uint64 tfva)
 {
+  uvmunmap(pagetable, tfva, 1, 0);
+  if(kdrop(pagetable))
+    return;
   uvmunmap(pagetable, TRAMPOLINE, 1, 0);
-  uvmunmap(pagetable, TRAPFRAME, 1, 0);
   uvmfree(pagetable, sz);
 }
 
@@ -242,28 +444,71 @@ userinit(void)
   safestrcpy(p->name, "initcode", sizeof(p->name));
   p->cwd = namei("/");
 
-  p->state = RUNNABLE;
+  setrunnable(p);
+
+  release(&p->lock);
+}
+
+// A kernel thread's very first scheduling by scheduler()
+// will swtch to kthreadstart.
+static void
+kthreadstart(void)
+{
+  struct proc *p = myproc();
+
+  // Still holding p->lock from scheduler.
+  release(&p->lock);
 
+  p->kfn();
+  panic("kthread returned");
+}
+
+// Start a kernel thread that runs fn, for kernel daemons
+// such as the log's commit thread. It never returns to
+// user space, has no parent, and fn must never return.
+void
+kthread(void (*fn)(void), char *name)
+{
+  struct proc *p;
+
+  if((p = allocproc()) == 0)
+    panic("kthread");
+  p->kfn = fn;
+  p->context.ra = (uint64)kthreadstart;
+  safestrcpy(p->name, name, sizeof(p->name));
+  setrunnable(p);
   release(&p->lock);
 }
 
 // Grow or shrink user memory by n bytes.
+// Growing is lazy: it only reserves the address range,
+// and vmfault() maps zeroed pages as they are first touched.
+// Threads that share the page table see the new size too;
+// vmtab->lock serializes their sbrk()s.
 // Return 0 on success, -1 on failure.
 int
 growproc(int n)
 {
-  uint sz;
+  uint64 sz;
   struct proc *p = myproc();
+  struct vmtab *vt = p->vmtab;
+  struct proc *t;
 
+  acquire(&vt->lock);
   sz = p->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n)) == 0) {
+    if(sz + n > USERTOP || vmaoverlap(p, sz, sz + n)){
+      release(&vt->lock);
       return -1;
     }
+    sz += n;
   } else if(n < 0){
     sz = uvmdealloc(p->pagetable, sz, sz + n);
   }
-  p->sz = sz;
+  for(t = proc; t < &proc[NPROC]; t++)
+    if(t->vmtab == vt)
+      t->sz = sz;
+  release(&vt->lock);
   return 0;
 }
 
@@ -281,13 +526,27 @@ fork(void)
     return -1;
   }
 
-  // Copy user memory from parent to child.
+  // Copy user memory from parent to child, while
+  // p's threads cannot change p's page table.
+  acquire(&p->vmtab->lock);
   if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0){
+    release(&p->vmtab->lock);
     freeproc(np);
     release(&np->lock);
     return -1;
   }
   np->sz = p->sz;
+  release(&p->vmtab->lock);
+
+  // mmapfork() may sleep, so it can't run under np->lock.
+  // np is not RUNNABLE yet, so nothing else touches it.
+  release(&np->lock);
+  if(mmapfork(p, np, 0) < 0){
+    acquire(&np->lock);
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
 
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
@@ -303,16 +562,80 @@ fork(void)
 
   safestrcpy(np->name, p->name, sizeof(p->name));
 
+  // the child starts at the top of its parent's base priority.
+  np->base = np->prio = p->base;
+
   pid = np->pid;
 
+  acquire(&wait_lock);
+  np->parent = p;
+  release(&wait_lock);
+
+  acquire(&np->lock);
+  setrunnable(np);
   release(&np->lock);
 
+  return pid;
+}
+
+// Create a thread: a new process that shares the caller's
+// page table, and so its memory, and that starts in user
+// space by calling fn(arg) on the given stack. Like a fork()
+// child, it gets references to the caller's open files and
+// cwd. Returns the thread's pid, for join().
+int
+clone(uint64 fn, uint64 arg, uint64 stack)
+{
+  int i, pid;
+  struct proc *np;
+  struct proc *p = myproc();
+
+  if((np = allocproc()) == 0){
+    return -1;
+  }
+
+  // Share the caller's page table instead of the new one.
+  proc_freepagetable(np->pagetable, 0, np->tfva);
+  np->pagetable = 0;
+  np->tfva = THREADFRAME(np - proc);
+  acquire(&p->vmtab->lock);
+  if(mappages(p->pagetable, np->tfva, PGSIZE,
+              (uint64)np->trapframe, PTE_R | PTE_W) < 0){
+    release(&p->vmtab->lock);
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+  release(&p->vmtab->lock);
+  kdup(p->pagetable);
+  np->pagetable = p->pagetable;
+  // as in fork(), np is not RUNNABLE yet.
+  release(&np->lock);
+  mmapfork(p, np, 1);
+
+  // start at fn(arg), with the caller's other registers.
+  *(np->trapframe) = *(p->trapframe);
+  np->trapframe->epc = fn;
+  np->trapframe->sp = stack;
+  np->trapframe->a0 = arg;
+  np->trapframe->ra = 0;
+
+  for(i = 0; i < NOFILE; i++)
+    if(p->ofile[i])
+      np->ofile[i] = filedup(p->ofile[i]);
+  np->cwd = idup(p->cwd);
+
+  safestrcpy(np->name, p->name, sizeof(p->name));
+  np->base = np->prio = p->base;
+
+  pid = np->pid;
+
   acquire(&wait_lock);
   np->parent = p;
   release(&wait_lock);
 
   acquire(&np->lock);
-  np->state = RUNNABLE;
+  setrunnable(np);
   release(&np->lock);
 
   return pid;
@@ -353,6 +676,8 @@ exit(int status)
     }
   }
 
+  munmapall(p);
+
   begin_op();
   iput(p->cwd);
   end_op();
@@ -382,18 +707,40 @@ exit(int status)
 // Return -1 if this process has no children.
 int
 wait(uint64 addr)
+{
+  return waitpid(0, addr);
+}
+
+// Wait for the thread tid, a child made by clone(),
+// to exit and return tid, or -1 if there is no such child.
+int
+join(int tid)
+{
+  if(tid <= 0)
+    return -1;
+  return waitpid(tid, 0);
+}
+
+// Wait for child pid, or any child if pid is 0, to exit
+// and return its pid. Return -1 if there is no such child.
+static int
+waitpid(int wpid, uint64 addr)
 {
   struct proc *np;
   int havekids, pid;
   struct proc *p = myproc();
 
+  // the copyout of the status below runs under spinlocks.
+  if(addr != 0)
+    mmapprefault(addr, sizeof(int), VMWRITE);
+
   acquire(&wait_lock);
 
   for(;;){
     // Scan through table looking for exited children.
     havekids = 0;
     for(np = proc; np < &proc[NPROC]; np++){
-      if(np->parent == p){
+      if(np->parent == p && (wpid == 0 || np->pid == wpid)){
         // make sure the child isn't still in exit() or swtch().
         acquire(&np->lock);
 
@@ -427,10 +774,36 @@ wait(uint64 addr)
   }
 }
 
+// Wait in wfi until an interrupt arrives. setrunnable()
+// sends an IPI to a CPU marked idle. Interrupts stay off
+// from the last look at the run queues until wfi, which
+// returns if one is already pending, so none is missed.
+static void
+idle(struct cpu *c)
+{
+  uint64 t0;
+  int i;
+
+  intr_off();
+  __atomic_store_n(&c->idle, 1, __ATOMIC_SEQ_CST);
+  for(i = 0; i < NCPU; i++){
+    if(__atomic_load_n(&runq[i].n, __ATOMIC_SEQ_CST) > 0)
+      break;
+  }
+  if(i == NCPU){
+    t0 = *(volatile uint64*)CLINT_MTIME;
+    wfi();
+    c->idletime += *(volatile uint64*)CLINT_MTIME - t0;
+    c->nidle++;
+  }
+  __atomic_store_n(&c->idle, 0, __ATOMIC_SEQ_CST);
+}
+
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
-//  - choose a process to run.
+//  - choose a process to run, from this CPU's run queue
+//    or, if that is empty, from another CPU's.
 //  - swtch to start running that process.
 //  - eventually that process transfers control
 //    via swtch back to the scheduler.
@@ -439,28 +812,42 @@ scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  struct runq *rq = &runq[cpuid()];
+  int i;
   
   c->proc = 0;
   for(;;){
     // Avoid deadlock by ensuring that devices can interrupt.
     intr_on();
 
-    for(p = proc; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
-      if(p->state == RUNNABLE) {
-        // Switch to chosen process.  It is the process's job
-        // to release its lock and then reacquire it
-        // before jumping back to us.
-        p->state = RUNNING;
-        c->proc = p;
-        swtch(&c->context, &p->context);
-
-        // Process is done running for now.
-        // It should have changed its p->state before coming back.
-        c->proc = 0;
+    if((p = dequeue(rq)) == 0){
+      for(i = 1; i < NCPU && p == 0; i++)
+        p = dequeue(&runq[(rq - runq + i) % NCPU]);
+      if(p == 0){
+        idle(c);
+        continue;
       }
-      release(&p->lock);
+      rq->nsteal++;
     }
+    rq->nrun++;
+
+    // The CPU that queued p may not have switched away
+    // from it yet; acquiring p->lock waits until it has.
+    acquire(&p->lock);
+    if(p->state != RUNNABLE)
+      panic("scheduler: not runnable");
+
+    // Switch to chosen process.  It is the process's job
+    // to release its lock and then reacquire it
+    // before jumping back to us.
+    p->state = RUNNING;
+    c->proc = p;
+    swtch(&c->context, &p->context);
+
+    // Process is done running for now.
+    // It should have changed its p->state before coming back.
+    c->proc = 0;
+    release(&p->lock);
   }
 }
 
@@ -497,7 +884,7 @@ yield(void)
 {
   struct proc *p = myproc();
   acquire(&p->lock);
-  p->state = RUNNABLE;
+  setrunnable(p);
   sched();
   release(&p->lock);
 }
@@ -529,28 +916,40 @@ void
 sleep(void *chan, struct spinlock *lk)
 {
   struct proc *p = myproc();
+  struct waitq *wq = WAITQ(chan);
+  struct proc **pp;
   
   // Must acquire p->lock in order to
   // change p->state and then call sched.
-  // Once we hold p->lock, we can be
-  // guaranteed that we won't miss any wakeup
-  // (wakeup locks p->lock),
-  // so it's okay to release lk.
+  // Once we are on chan's wait queue, we
+  // can be guaranteed that we won't miss
+  // any wakeup (wakeup locks the queue, and
+  // then p->lock), so it's okay to release lk.
 
+  acquire(&wq->lock);
   acquire(&p->lock);  //DOC: sleeplock1
   release(lk);
 
   // Go to sleep.
   p->chan = chan;
   p->state = SLEEPING;
+  p->wqnext = wq->head;
+  wq->head = p;
+  release(&wq->lock);
 
   sched();
 
   // Tidy up.
   p->chan = 0;
+  release(&p->lock);
+
+  acquire(&wq->lock);
+  for(pp = &wq->head; *pp != p; pp = &(*pp)->wqnext)
+    ;
+  *pp = p->wqnext;
+  release(&wq->lock);
 
   // Reacquire original lock.
-  release(&p->lock);
   acquire(lk);
 }
 
@@ -559,41 +958,195 @@ sleep(void *chan, struct spinlock *lk)
 void
 wakeup(void *chan)
 {
+  wakeupn(chan, -1);
+}
+
+// Wake up at most n processes sleeping on chan, or all
+// of them if n < 0. Returns the number woken.
+// Must be called without any p->lock.
+int
+wakeupn(void *chan, int n)
+{
+  struct waitq *wq = WAITQ(chan);
   struct proc *p;
+  int woken = 0;
 
-  for(p = proc; p < &proc[NPROC]; p++) {
+  acquire(&wq->lock);
+  for(p = wq->head; p != 0 && woken != n; p = p->wqnext) {
     if(p != myproc()){
       acquire(&p->lock);
       if(p->state == SLEEPING && p->chan == chan) {
-        p->state = RUNNABLE;
+        setrunnable(p);
+        woken++;
       }
       release(&p->lock);
     }
   }
+  release(&wq->lock);
+  return woken;
+}
+
+// FUTEX_WAIT: if the word at user address addr holds val,
+// sleep until a FUTEX_WAKE on it; returns 0, or -1 at once
+// if the word differs. FUTEX_WAKE: wake up to val sleepers
+// and return how many there were. Returns -1 on a bad
+// address or op, or if the caller is killed.
+int
+futex(uint64 addr, int op, int val)
+{
+  struct proc *p = myproc();
+  struct spinlock *lk;
+  struct vma *vm;
+  uint64 pa, key;
+  int v, r, shared;
+
+  if(addr % sizeof(int) != 0)
+    return -1;
+  if((pa = vmfault(p->pagetable, addr, p->sz, VMREAD)) == 0)
+    return -1;
+  acquire(&p->vmtab->lock);
+  vm = vmalookup(p->vmtab, addr);
+  shared = vm && (vm->flags & MAP_SHARED);
+  release(&p->vmtab->lock);
+  if(shared)
+    key = pa + addr % PGSIZE;
+  else
+    key = FUTEXKEY(p->pagetable, addr);
+  lk = &futexlock[(key >> 2) % NFUTEX];
+
+  acquire(lk);
+  if(op == FUTEX_WAIT){
+    if(copyin(p->pagetable, (char*)&v, addr, sizeof(v)) < 0 || v != val){
+      r = -1;
+    } else {
+      sleep((void*)key, lk);
+      r = p->killed ? -1 : 0;
+    }
+  } else if(op == FUTEX_WAKE){
+    r = wakeupn((void*)key, val);
+  } else {
+    r = -1;
+  }
+  release(lk);
+  return r;
+}
+
+// Find the user process with the given pid and return
+// it with p->lock held, or return 0 if there is none.
+static struct proc*
+pidlookup(int pid)
+{
+  struct proc *p;
+
+  if(pid <= 0)
+    return 0;
+
+  acquire(&pid_lock);
+  for(p = *PIDHASH(pid); p != 0; p = p->pidnext)
+    if(p->pid == pid)
+      break;
+  release(&pid_lock);
+  if(p == 0)
+    return 0;
+
+  // pids are never reused, so if p has been freed
+  // since the lookup, p->pid no longer matches.
+  acquire(&p->lock);
+  if(p->pid != pid || p->kfn){
+    release(&p->lock);
+    return 0;
+  }
+  return p;
 }
 
 // Kill the process with the given pid.
 // The victim won't exit until it tries to return
-// to user space (see usertrap() in trap.c).
+// to user space (see usertrap() in trap.c), but
+// if it is sleeping, it is woken at once.
 int
 kill(int pid)
 {
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++){
-    acquire(&p->lock);
-    if(p->pid == pid){
-      p->killed = 1;
-      if(p->state == SLEEPING){
-        // Wake process from sleep().
-        p->state = RUNNABLE;
-      }
-      release(&p->lock);
-      return 0;
-    }
-    release(&p->lock);
+  if((p = pidlookup(pid)) == 0)
+    return -1;
+  p->killed = 1;
+  if(p->state == SLEEPING){
+    // Wake process from sleep().
+    setrunnable(p);
+  }
+  release(&p->lock);
+  return 0;
+}
+
+// Set the base priority level of process pid, or of the
+// caller if pid is 0, to prio: 0 is the highest level and
+// NPRIO-1 the lowest. The process moves to that level now,
+// and returns to it at each priority boost.
+int
+setpriority(int pid, int prio)
+{
+  struct proc *p;
+
+  if(prio < 0 || prio >= NPRIO)
+    return -1;
+  if(pid == 0)
+    pid = myproc()->pid;
+  if((p = pidlookup(pid)) == 0)
+    return -1;
+  p->base = prio;
+  p->prio = prio;
+  p->used = 0;
+  release(&p->lock);
+  return 0;
+}
+
+// Charge the running process for a timer tick. Returns 1 if
+// it should yield: it has used up its time at its level, and
+// so moves down a level, or a higher level has work queued
+// on this CPU.
+int
+schedtick(void)
+{
+  struct proc *p = myproc();
+  struct runq *rq;
+  int l, preempt = 0;
+
+  acquire(&p->lock);
+  boost(p);
+  if(++p->used >= QUANTUM(p->prio)){
+    if(p->prio < NPRIO-1)
+      p->prio++;
+    p->used = 0;
+    preempt = 1;
+  } else {
+    // racy peek; a miss only delays preemption a tick.
+    rq = &runq[cpuid()];
+    for(l = 0; l < p->prio; l++)
+      if(rq->level[l].head)
+        preempt = 1;
+  }
+  release(&p->lock);
+  return preempt;
+}
+
+// Report run queue and idle counters for the statistics
+// device. Idle time is a percentage of the time since boot.
+int
+schedstats(char *buf, int sz)
+{
+  uint64 now = *(volatile uint64*)CLINT_MTIME;
+  int n = 0;
+
+  for(int i = 0; i < NCPU; i++){
+    struct runq *rq = &runq[i];
+    struct cpu *c = &cpus[i];
+    if(rq->nrun == 0 && c->nidle == 0)
+      continue;
+    n += snprintf(buf+n, sz-n, "sched: cpu%d queued %d run %ld steal %ld idle %ld%%\n",
+                  i, rq->n, rq->nrun, rq->nsteal, c->idletime * 100 / now);
   }
-  return -1;
+  return n;
 }
 
 // Copy to either a user address, or kernel address,
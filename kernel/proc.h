@@ -24,6 +24,12 @@ struct cpu {
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  int idle;                   // In wfi, waiting for an IPI when there is work?
+  uint64 nticks;              // Timer interrupts seen by devintr().
+  pagetable_t upt;            // User page table while in user space, else 0.
+  uint64 ntrap;               // Traps from user space, for tlbshootdown().
+  uint64 nidle;               // Times this CPU went idle.
+  uint64 idletime;            // CLINT time units spent idle.
 };
 
 extern struct cpu cpus[NCPU];
@@ -82,6 +88,30 @@ struct trapframe {
 
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
+// A region of user memory backed by a file, made by mmap(),
+// or by exec() for a program segment.
+struct vma {
+  uint64 start;                // first address, page-aligned
+  uint64 end;                  // address after the last page; 0 if unused
+  int prot;                    // PROT_ bits from fcntl.h
+  int flags;                   // MAP_SHARED or MAP_PRIVATE
+  struct inode *ip;            // the file
+  uint off;                    // offset in the file of start
+  uint flen;                   // bytes from the file; the rest are zero
+};
+
+// The state of a user address space besides its page table,
+// shared by the threads that share the page table: its table
+// of regions. Its lock protects the regions, and serializes
+// the threads' changes to the page table and to their sz.
+struct vmtab {
+  struct spinlock lock;
+  int ref;                     // processes using the table
+  int busy;                    // an mmap() or munmap() is under way
+  int nfault;                  // mmapfault()s reading from files
+  struct vma vma[NVMA];
+};
+
 // Per-process state
 struct proc {
   struct spinlock lock;
@@ -92,17 +122,34 @@ struct proc {
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
+  int prio;                    // Scheduling level, 0 is the highest
+  int base;                    // Level to go back to at a boost
+  int used;                    // Ticks run at this level
+  uint epoch;                  // Boost period p->prio belongs to
+
+  // the lock of the run queue that p is on protects this:
+  struct proc *rqnext;         // next RUNNABLE process on the queue
+
+  // the lock of chan's wait queue protects this:
+  struct proc *wqnext;         // next process sleeping in the queue
+
+  // pid_lock must be held when using this:
+  struct proc *pidnext;        // next process in the pid hash chain
 
   // wait_lock must be held when using this:
   struct proc *parent;         // Parent process
 
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;               // Virtual address of kernel stack
-  uint64 sz;                   // Size of process memory (bytes)
-  pagetable_t pagetable;       // User page table
+  uint64 sz;                   // Size of process memory (bytes); threads'
+                               // copies change under vmtab->lock
+  pagetable_t pagetable;       // User page table, shared by threads
   struct trapframe *trapframe; // data page for trampoline.S
+  uint64 tfva;                 // where trapframe is mapped in pagetable
   struct context context;      // swtch() here to run process
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
+  struct vmtab *vmtab;         // address space state, shared by threads
   char name[16];               // Process name (debugging)
+  void (*kfn)(void);           // Body of a kernel thread, or 0
 };
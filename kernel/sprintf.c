@@ -0,0 +1,117 @@
+//
+// formatted output to a buffer -- snprintf.
+//
+
+#include <stdarg.h>
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+
+static char digits[] = "0123456789abcdef";
+
+// Append c to buf unless it is full.
+// Always leaves room for the terminating NUL.
+static void
+sputc(char *buf, int sz, int *n, char c)
+{
+  if(*n < sz - 1)
+    buf[(*n)++] = c;
+}
+
+static void
+sprintint(char *buf, int sz, int *n, uint64 x, int base, int sign)
+{
+  char tmp[24];
+  int i;
+
+  if(sign && (sign = ((long)x < 0)))
+    x = -x;
+
+  i = 0;
+  do {
+    tmp[i++] = digits[x % base];
+  } while((x /= base) != 0);
+
+  if(sign)
+    tmp[i++] = '-';
+
+  while(--i >= 0)
+    sputc(buf, sz, n, tmp[i]);
+}
+
+// Print into buf, which holds sz bytes, always NUL-terminating.
+// Understands %d, %u, %x, %p, %s, and the l modifier
+// (%ld, %lu, %lx) for 64-bit values.
+// Returns the number of characters stored, not counting the NUL.
+int
+snprintf(char *buf, int sz, char *fmt, ...)
+{
+  va_list ap;
+  int i, c, n, lng;
+  char *s;
+
+  if(sz <= 0)
+    return 0;
+
+  n = 0;
+  va_start(ap, fmt);
+  for(i = 0; (c = fmt[i] & 0xff) != 0; i++){
+    if(c != '%'){
+      sputc(buf, sz, &n, c);
+      continue;
+    }
+    c = fmt[++i] & 0xff;
+    lng = 0;
+    if(c == 'l'){
+      lng = 1;
+      c = fmt[++i] & 0xff;
+    }
+    if(c == 0)
+      break;
+    switch(c){
+    case 'd':
+      if(lng)
+        sprintint(buf, sz, &n, va_arg(ap, uint64), 10, 1);
+      else
+        sprintint(buf, sz, &n, (uint64)(long)va_arg(ap, int), 10, 1);
+      break;
+    case 'u':
+      if(lng)
+        sprintint(buf, sz, &n, va_arg(ap, uint64), 10, 0);
+      else
+        sprintint(buf, sz, &n, va_arg(ap, uint), 10, 0);
+      break;
+    case 'x':
+      if(lng)
+        sprintint(buf, sz, &n, va_arg(ap, uint64), 16, 0);
+      else
+        sprintint(buf, sz, &n, va_arg(ap, uint), 16, 0);
+      break;
+    case 'p':
+      sputc(buf, sz, &n, '0');
+      sputc(buf, sz, &n, 'x');
+      sprintint(buf, sz, &n, va_arg(ap, uint64), 16, 0);
+      break;
+    case 's':
+      if((s = va_arg(ap, char*)) == 0)
+        s = "(null)";
+      for(; *s; s++)
+        sputc(buf, sz, &n, *s);
+      break;
+    case '%':
+      sputc(buf, sz, &n, '%');
+      break;
+    default:
+      // Print unknown % sequence to draw attention.
+      sputc(buf, sz, &n, '%');
+      sputc(buf, sz, &n, c);
+      break;
+    }
+  }
+  va_end(ap);
+  buf[n] = 0;
+  return n;
+}
@@ -0,0 +1,82 @@
+//
+// The statistics device. Reading it returns a text snapshot
+// of the kernel's performance counters, a few lines per
+// subsystem. user/stats.c prints it.
+//
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define STATSBUF (2*PGSIZE)
+
+// Each reporter writes at most sz bytes of text into buf
+// and returns the number of bytes written.
+static int (*reporters[])(char*, int) = {
+  kallocstats,
+  schedstats,
+  bcachestats,
+  logstats,
+  itablestats,
+  dcachestats,
+  pcachestats,
+};
+
+static struct {
+  struct spinlock lock;
+  char buf[STATSBUF];
+} stats;
+
+static int
+statswrite(int user_src, uint64 src, int n)
+{
+  return -1;
+}
+
+// Each read takes a fresh snapshot and returns up to a page
+// of it from the file's offset off, so readers of different
+// open files don't disturb each other. The bytes are copied
+// out after stats.lock is released, since copyout() may sleep
+// on a page fault.
+static int
+statsread(int user_dst, uint64 dst, int n, uint off)
+{
+  char *page;
+  int m, sz;
+
+  if((page = kalloc()) == 0)
+    return -1;
+  acquire(&stats.lock);
+  sz = 0;
+  for(int i = 0; i < NELEM(reporters); i++)
+    sz += reporters[i](stats.buf + sz, STATSBUF - sz);
+  m = 0;
+  if(off < sz){
+    m = sz - off;
+    if(m > n)
+      m = n;
+    if(m > PGSIZE)
+      m = PGSIZE;
+    memmove(page, stats.buf + off, m);
+  }
+  release(&stats.lock);
+
+  if(m > 0 && either_copyout(user_dst, dst, page, m) == -1)
+    m = -1;
+  kfree(page);
+  return m;
+}
+
+void
+statsinit(void)
+{
+  initlock(&stats.lock, "stats");
+
+  devsw[STATS].read = statsread;
+  devsw[STATS].write = statswrite;
+}
@@ -1,13 +1,44 @@
 #include "types.h"
 
+// memset, memmove and memcmp work a 64-bit word at a time,
+// eight words per loop iteration, once the pointers are
+// aligned, with byte loops for the unaligned head and the
+// tail. memmove and memcmp can only use words when both
+// pointers have the same alignment, which the page- and
+// block-sized copies that dominate (kalloc, uvmcopy, bio,
+// copyin/copyout of aligned buffers) do.
+
+typedef uint64 __attribute__((may_alias)) word;
+#define WSIZE sizeof(word)
+#define ALIGNED(p) (((uint64)(p) & (WSIZE-1)) == 0)
+#define SAMEALIGN(p, q) ((((uint64)(p) ^ (uint64)(q)) & (WSIZE-1)) == 0)
+
 void*
 memset(void *dst, int c, uint n)
 {
-  char *cdst = (char *) dst;
-  int i;
-  for(i = 0; i < n; i++){
-    cdst[i] = c;
+  uchar *d = dst;
+  word w, *wd;
+
+  while(n > 0 && !ALIGNED(d)){
+    *d++ = c;
+    n--;
+  }
+  if(n >= WSIZE){
+    w = (uchar)c;
+    w |= w << 8;
+    w |= w << 16;
+    w |= w << 32;
+    wd = (word*)d;
+    for(; n >= 8*WSIZE; n -= 8*WSIZE, wd += 8){
+      wd[0] = w; wd[1] = w; wd[2] = w; wd[3] = w;
+      wd[4] = w; wd[5] = w; wd[6] = w; wd[7] = w;
+    }
+    for(; n >= WSIZE; n -= WSIZE)
+      *wd++ = w;
+    d = (uchar*)wd;
   }
+  while(n-- > 0)
+    *d++ = c;
   return dst;
 }
 
@@ -18,6 +49,18 @@ memcmp(const void *v1, const void *v2, uint n)
 
   s1 = v1;
   s2 = v2;
+  if(SAMEALIGN(s1, s2)){
+    while(n > 0 && !ALIGNED(s1)){
+      if(*s1 != *s2)
+        return *s1 - *s2;
+      s1++, s2++, n--;
+    }
+    // skip equal words; the byte loop below finds
+    // the first difference in an unequal one.
+    while(n >= WSIZE && *(word*)s1 == *(word*)s2){
+      s1 += WSIZE, s2 += WSIZE, n -= WSIZE;
+    }
+  }
   while(n-- > 0){
     if(*s1 != *s2)
       return *s1 - *s2;
@@ -32,6 +75,8 @@ memmove(void *dst, const void *src, uint n)
 {
   const char *s;
   char *d;
+  const word *ws;
+  word *wd;
 
   if(n == 0)
     return dst;
@@ -39,13 +84,48 @@ memmove(void *dst, const void *src, uint n)
   s = src;
   d = dst;
   if(s < d && s + n > d){
+    // overlapping, so copy backwards.
     s += n;
     d += n;
+    if(SAMEALIGN(s, d)){
+      while(n > 0 && !ALIGNED(d)){
+        *--d = *--s;
+        n--;
+      }
+      ws = (const word*)s;
+      wd = (word*)d;
+      for(; n >= 8*WSIZE; n -= 8*WSIZE){
+        ws -= 8, wd -= 8;
+        wd[7] = ws[7]; wd[6] = ws[6]; wd[5] = ws[5]; wd[4] = ws[4];
+        wd[3] = ws[3]; wd[2] = ws[2]; wd[1] = ws[1]; wd[0] = ws[0];
+      }
+      for(; n >= WSIZE; n -= WSIZE)
+        *--wd = *--ws;
+      s = (const char*)ws;
+      d = (char*)wd;
+    }
     while(n-- > 0)
       *--d = *--s;
-  } else
+  } else {
+    if(SAMEALIGN(s, d)){
+      while(n > 0 && !ALIGNED(d)){
+        *d++ = *s++;
+        n--;
+      }
+      ws = (const word*)s;
+      wd = (word*)d;
+      for(; n >= 8*WSIZE; n -= 8*WSIZE, ws += 8, wd += 8){
+        wd[0] = ws[0]; wd[1] = ws[1]; wd[2] = ws[2]; wd[3] = ws[3];
+        wd[4] = ws[4]; wd[5] = ws[5]; wd[6] = ws[6]; wd[7] = ws[7];
+      }
+      for(; n >= WSIZE; n -= WSIZE)
+        *wd++ = *ws++;
+      s = (const char*)ws;
+      d = (char*)wd;
+    }
     while(n-- > 0)
       *d++ = *s++;
+  }
 
   return dst;
 }
@@ -75,7 +75,7 @@ sys_read(void)
 
   if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argaddr(1, &p) < 0)
     return -1;
-  return fileread(f, p, n);
+  return fileread(f, 1, p, n);
 }
 
 uint64
@@ -88,7 +88,7 @@ sys_write(void)
   if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argaddr(1, &p) < 0)
     return -1;
 
-  return filewrite(f, p, n);
+  return filewrite(f, 1, p, n);
 }
 
 uint64
@@ -166,16 +166,17 @@ bad:
 }
 
 // Is the directory dp empty except for "." and ".." ?
+// In an indexed directory they can be in any bucket.
 static int
 isdirempty(struct inode *dp)
 {
   int off;
   struct dirent de;
 
-  for(off=2*sizeof(de); off<dp->size; off+=sizeof(de)){
+  for(off=0; off<dp->size; off+=sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
       panic("isdirempty: readi");
-    if(de.inum != 0)
+    if(de.inum != 0 && namecmp(de.name, ".") != 0 && namecmp(de.name, "..") != 0)
       return 0;
   }
   return 1;
@@ -218,6 +219,7 @@ sys_unlink(void)
   memset(&de, 0, sizeof(de));
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     panic("unlink: writei");
+  dcacheremove(dp, name);
   if(ip->type == T_DIR){
     dp->nlink--;
     iupdate(dp);
@@ -268,19 +270,31 @@ create(char *path, short type, short major, short minor)
   iupdate(ip);
 
   if(type == T_DIR){  // Create . and .. entries.
-    dp->nlink++;  // for ".."
-    iupdate(dp);
     // No ip->nlink++ for ".": avoid cyclic ref count.
     if(dirlink(ip, ".", ip->inum) < 0 || dirlink(ip, "..", dp->inum) < 0)
       panic("create dots");
   }
 
   if(dirlink(dp, name, ip->inum) < 0)
-    panic("create: dirlink");
+    goto fail;
+
+  if(type == T_DIR){
+    // now that success is guaranteed:
+    dp->nlink++;  // for ".."
+    iupdate(dp);
+  }
 
   iunlockput(dp);
 
   return ip;
+
+fail:
+  // de-allocate ip.
+  ip->nlink = 0;
+  iupdate(ip);
+  iunlockput(ip);
+  iunlockput(dp);
+  return 0;
 }
 
 uint64
@@ -484,3 +498,85 @@ sys_pipe(void)
   }
   return 0;
 }
+
+// Control an open file. Only pipes have anything
+// to control so far: see pipefcntl().
+uint64
+sys_fcntl(void)
+{
+  struct file *f;
+  int cmd, arg;
+
+  if(argfd(0, 0, &f) < 0 || argint(1, &cmd) < 0 || argint(2, &arg) < 0)
+    return -1;
+  if(f->type != FD_PIPE)
+    return -1;
+  return pipefcntl(f->pipe, cmd, arg);
+}
+
+// Move up to n bytes from fdin to fdout, at least one of them
+// a pipe, without copying them through user space. Returns the
+// number of bytes moved, which may be fewer than n, or 0 at the
+// end of fdin.
+uint64
+sys_splice(void)
+{
+  struct file *in, *out;
+  int n;
+
+  if(argfd(0, 0, &in) < 0 || argfd(1, 0, &out) < 0 || argint(2, &n) < 0)
+    return -1;
+  if(n < 0 || in->readable == 0 || out->writable == 0)
+    return -1;
+  if(in->type == FD_PIPE && out->type == FD_PIPE)
+    return pipetee(in->pipe, out->pipe, n, 1);
+  if(in->type == FD_PIPE)
+    return pipespliceout(in->pipe, out, n);
+  if(out->type == FD_PIPE)
+    return pipesplicein(out->pipe, in, n);
+  return -1;
+}
+
+// Copy up to n bytes from pipe fdin to pipe fdout,
+// leaving them unread in fdin.
+uint64
+sys_tee(void)
+{
+  struct file *in, *out;
+  int n;
+
+  if(argfd(0, 0, &in) < 0 || argfd(1, 0, &out) < 0 || argint(2, &n) < 0)
+    return -1;
+  if(n < 0 || in->readable == 0 || out->writable == 0 ||
+     in->type != FD_PIPE || out->type != FD_PIPE)
+    return -1;
+  return pipetee(in->pipe, out->pipe, n, 0);
+}
+
+// mmap(addr, len, prot, flags, fd, off) maps a file into
+// memory; addr is only a hint, and is ignored.
+uint64
+sys_mmap(void)
+{
+  struct file *f;
+  uint64 addr;
+  int len, prot, flags, off;
+
+  if(argaddr(0, &addr) < 0 || argint(1, &len) < 0 || argint(2, &prot) < 0 ||
+     argint(3, &flags) < 0 || argfd(4, 0, &f) < 0 || argint(5, &off) < 0)
+    return -1;
+  if(len <= 0 || off < 0)
+    return -1;
+  return mmap(len, prot, flags, f, off);
+}
+
+uint64
+sys_munmap(void)
+{
+  uint64 addr;
+  int len;
+
+  if(argaddr(0, &addr) < 0 || argint(1, &len) < 0 || len < 0)
+    return -1;
+  return munmap(addr, len);
+}
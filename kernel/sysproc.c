@@ -73,6 +73,37 @@ sys_sleep(void)
   return 0;
 }
 
+uint64
+sys_clone(void)
+{
+  uint64 fn, arg, stack;
+
+  if(argaddr(0, &fn) < 0 || argaddr(1, &arg) < 0 || argaddr(2, &stack) < 0)
+    return -1;
+  return clone(fn, arg, stack);
+}
+
+uint64
+sys_join(void)
+{
+  int tid;
+
+  if(argint(0, &tid) < 0)
+    return -1;
+  return join(tid);
+}
+
+uint64
+sys_futex(void)
+{
+  uint64 addr;
+  int op, val;
+
+  if(argaddr(0, &addr) < 0 || argint(1, &op) < 0 || argint(2, &val) < 0)
+    return -1;
+  return futex(addr, op, val);
+}
+
 uint64
 sys_kill(void)
 {
@@ -83,6 +114,16 @@ sys_kill(void)
   return kill(pid);
 }
 
+uint64
+sys_setpriority(void)
+{
+  int pid, prio;
+
+  if(argint(0, &pid) < 0 || argint(1, &prio) < 0)
+    return -1;
+  return setpriority(pid, prio);
+}
+
 // return how many clock tick interrupts have occurred
 // since start.
 uint64
@@ -16,6 +16,10 @@ void kernelvec();
 
 extern int devintr();
 
+// start.c; timervec in kernelvec.S counts each CPU's
+// timer interrupts in timer_scratch[id][5].
+extern uint64 timer_scratch[NCPU][TSCRATCH];
+
 void
 trapinit(void)
 {
@@ -45,6 +49,11 @@ usertrap(void)
   // since we're now in the kernel.
   w_stvec((uint64)kernelvec);
 
+  // uservec has flushed the TLB; tell tlbshootdown().
+  struct cpu *c = mycpu();
+  __atomic_store_n(&c->upt, 0, __ATOMIC_SEQ_CST);
+  __atomic_add_fetch(&c->ntrap, 1, __ATOMIC_SEQ_CST);
+
   struct proc *p = myproc();
   
   // save user program counter.
@@ -65,6 +74,13 @@ usertrap(void)
     intr_on();
 
     syscall();
+  } else if((r_scause() == 12 || r_scause() == 13 || r_scause() == 15) &&
+            vmfault(p->pagetable, r_stval(), p->sz,
+                    r_scause() == 12 ? VMEXEC :
+                    r_scause() == 15 ? VMWRITE : VMREAD) != 0){
+    // instruction fetch, load or store to a lazily-allocated
+    // heap page or a program or mmap() page not yet read in,
+    // or store to a copy-on-write page; the page is now mapped.
   } else if((which_dev = devintr()) != 0){
     // ok
   } else {
@@ -76,9 +92,14 @@ usertrap(void)
   if(p->killed)
     exit(-1);
 
-  // give up the CPU if this is a timer interrupt.
-  if(which_dev == 2)
+  // give up the CPU if this timer interrupt ends p's
+  // time slice. p may have been killed while it waited
+  // to run again.
+  if(which_dev == 2 && schedtick()){
     yield();
+    if(p->killed)
+      exit(-1);
+  }
 
   usertrapret();
 }
@@ -118,14 +139,16 @@ usertrapret(void)
   // set S Exception Program Counter to the saved user pc.
   w_sepc(p->trapframe->epc);
 
-  // tell trampoline.S the user page table to switch to.
+  // tell trampoline.S the user page table to switch to,
+  // and tlbshootdown() that this CPU will be using it.
   uint64 satp = MAKE_SATP(p->pagetable);
+  __atomic_store_n(&mycpu()->upt, p->pagetable, __ATOMIC_SEQ_CST);
 
   // jump to trampoline.S at the top of memory, which 
   // switches to the user page table, restores user registers,
   // and switches to user mode with sret.
   uint64 fn = TRAMPOLINE + (userret - trampoline);
-  ((void (*)(uint64,uint64))fn)(TRAPFRAME, satp);
+  ((void (*)(uint64,uint64))fn)(p->tfva, satp);
 }
 
 // interrupts and exceptions from kernel code go here via kernelvec,
@@ -149,8 +172,10 @@ kerneltrap()
     panic("kerneltrap");
   }
 
-  // give up the CPU if this is a timer interrupt.
-  if(which_dev == 2 && myproc() != 0 && myproc()->state == RUNNING)
+  // give up the CPU if this timer interrupt ends the
+  // current process's time slice.
+  if(which_dev == 2 && myproc() != 0 && myproc()->state == RUNNING &&
+     schedtick())
     yield();
 
   // the yield() may have caused some traps to occur,
@@ -159,6 +184,15 @@ kerneltrap()
   w_sstatus(sstatus);
 }
 
+// Interrupt CPU id, e.g. to wake it from wfi. The CLINT
+// raises a machine-mode software interrupt, which timervec
+// in kernelvec.S forwards as a supervisor one.
+void
+ipi(int id)
+{
+  *(volatile uint32*)CLINT_MSIP(id) = 1;
+}
+
 void
 clockintr()
 {
@@ -201,17 +235,28 @@ devintr()
 
     return 1;
   } else if(scause == 0x8000000000000001L){
-    // software interrupt from a machine-mode timer interrupt,
-    // forwarded by timervec in kernelvec.S.
+    // software interrupt from a machine-mode timer interrupt
+    // or IPI, forwarded by timervec in kernelvec.S.
+    int id = cpuid();
+    struct cpu *c = mycpu();
+    uint64 n;
 
-    if(cpuid() == 0){
-      clockintr();
-    }
-    
     // acknowledge the software interrupt by clearing
-    // the SSIP bit in sip.
+    // the SSIP bit in sip, before looking at the tick
+    // count so that a later tick raises it again.
     w_sip(r_sip() & ~2);
 
+    n = __atomic_load_n(&timer_scratch[id][5], __ATOMIC_SEQ_CST);
+    if(n == c->nticks){
+      // an IPI only has to wake the CPU from wfi;
+      // scheduler() then looks at the run queues.
+      return 1;
+    }
+    for(; c->nticks != n; c->nticks++){
+      if(id == 0)
+        clockintr();
+    }
+
     return 2;
   } else {
     return 0;
@@ -44,8 +44,10 @@
 #define VIRTIO_RING_F_EVENT_IDX     29
 
 // this many virtio descriptors.
-// must be a power of two.
-#define NUM 8
+// must be a power of two, and the descriptors plus the
+// avail ring must fit in the first page of disk.pages[].
+// each request takes three, so NUM/3 can be in flight.
+#define NUM 128
 
 // a single descriptor, from the spec.
 struct virtq_desc {
@@ -56,6 +56,7 @@ static struct disk {
   // our own book-keeping.
   char free[NUM];  // is a descriptor free?
   uint16 used_idx; // we've looked this far in used[2..NUM].
+  int unkicked;    // requests the device hasn't been told about.
 
   // track info about in-flight operations,
   // for use when completion interrupt arrives.
@@ -200,8 +201,25 @@ alloc3_desc(int *idx)
   return 0;
 }
 
+// tell the device about requests queued since the last kick.
+// caller must hold vdisk_lock.
+static void
+kick(void)
+{
+  if(disk.unkicked > 0){
+    __sync_synchronize();
+    *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+    disk.unkicked = 0;
+  }
+}
+
+// Queue a read or write of b, without waiting for it to
+// finish and without telling the device yet; the caller
+// must call virtio_disk_kick() after queueing a batch,
+// then virtio_disk_wait() on each buf.
+// caller holds b->lock.
 void
-virtio_disk_rw(struct buf *b, int write)
+virtio_disk_submit(struct buf *b, int write)
 {
   uint64 sector = b->blockno * (BSIZE / 512);
 
@@ -212,11 +230,14 @@ virtio_disk_rw(struct buf *b, int write)
   // data, one for a 1-byte status result.
 
   // allocate the three descriptors.
+  // if the ring is full, start the requests queued so far,
+  // since they may be what will free some descriptors.
   int idx[3];
   while(1){
     if(alloc3_desc(idx) == 0) {
       break;
     }
+    kick();
     sleep(&disk.free[0], &disk.vdisk_lock);
   }
 
@@ -264,21 +285,40 @@ virtio_disk_rw(struct buf *b, int write)
   // tell the device another avail ring entry is available.
   disk.avail->idx += 1; // not % NUM ...
 
-  __sync_synchronize();
+  disk.unkicked++;
+
+  release(&disk.vdisk_lock);
+}
 
-  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+// Tell the device about all queued requests.
+void
+virtio_disk_kick(void)
+{
+  acquire(&disk.vdisk_lock);
+  kick();
+  release(&disk.vdisk_lock);
+}
 
-  // Wait for virtio_disk_intr() to say request has finished.
+// Wait for virtio_disk_intr() to say b's request has finished.
+void
+virtio_disk_wait(struct buf *b)
+{
+  acquire(&disk.vdisk_lock);
   while(b->disk == 1) {
     sleep(b, &disk.vdisk_lock);
   }
-
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
-
   release(&disk.vdisk_lock);
 }
 
+// Read or write b, and wait for it.
+void
+virtio_disk_rw(struct buf *b, int write)
+{
+  virtio_disk_submit(b, write);
+  virtio_disk_kick();
+  virtio_disk_wait(b);
+}
+
 void
 virtio_disk_intr()
 {
@@ -305,6 +345,8 @@ virtio_disk_intr()
       panic("virtio_disk_intr status");
 
     struct buf *b = disk.info[id].b;
+    disk.info[id].b = 0;
+    free_chain(id);
     b->disk = 0;   // disk is done with buf
     wakeup(b);
 
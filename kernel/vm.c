@@ -5,6 +5,8 @@
 #include "riscv.h"
 #include "defs.h"
 #include "fs.h"
+#include "spinlock.h"
+#include "proc.h"
 
 /*
  * the kernel's page table.
@@ -15,6 +17,8 @@ extern char etext[];  // kernel.ld sets this to end of kernel code.
 
 extern char trampoline[]; // trampoline.S
 
+static void freeunmapped(pagetable_t, uint64*, int);
+
 // Make a direct-map page table for the kernel.
 pagetable_t
 kvmmake(void)
@@ -30,6 +34,9 @@ kvmmake(void)
   // virtio mmio disk interface
   kvmmap(kpgtbl, VIRTIO0, VIRTIO0, PGSIZE, PTE_R | PTE_W);
 
+  // CLINT, for sending IPIs and reading the time
+  kvmmap(kpgtbl, CLINT, CLINT, 0x10000, PTE_R | PTE_W);
+
   // PLIC
   kvmmap(kpgtbl, PLIC, PLIC, 0x400000, PTE_R | PTE_W);
 
@@ -160,30 +167,83 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 }
 
 // Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
-// Optionally free the physical memory.
+// page-aligned. Pages that a lazy sbrk() never mapped
+// are skipped. Optionally free the physical memory.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 {
-  uint64 a;
+  uint64 a, pa[32];
   pte_t *pte;
+  int n = 0;
 
   if((va % PGSIZE) != 0)
     panic("uvmunmap: not aligned");
 
   for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
     if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
+      continue;
     if((*pte & PTE_V) == 0)
-      panic("uvmunmap: not mapped");
+      continue;
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
-    if(do_free){
-      uint64 pa = PTE2PA(*pte);
-      kfree((void*)pa);
-    }
+    if(do_free)
+      pa[n++] = PTE2PA(*pte);
     *pte = 0;
+    if(n == NELEM(pa)){
+      freeunmapped(pagetable, pa, n);
+      n = 0;
+    }
   }
+  freeunmapped(pagetable, pa, n);
+}
+
+// Free the n pages in pa, which uvmunmap() has just
+// unmapped from pagetable, once no TLB can refer to them.
+static void
+freeunmapped(pagetable_t pagetable, uint64 *pa, int n)
+{
+  if(n == 0)
+    return;
+  tlbshootdown(pagetable);
+  for(int i = 0; i < n; i++)
+    kfree((void*)pa[i]);
+}
+
+// The caller has removed or downgraded PTEs in pagetable.
+// Make every other CPU running user code on pagetable, a
+// thread sharing it, stop using the old PTEs, and wait until
+// it has. Entering the kernel from user space flushes a CPU's
+// TLB (see uservec in trampoline.S), so an IPI that makes it
+// trap is enough. This CPU is in the kernel already, and
+// flushes again on its way back to user space.
+void
+tlbshootdown(pagetable_t pagetable)
+{
+  uint64 n[NCPU];
+  int i, me, sent[NCPU];
+
+  if(krefcnt(pagetable) <= 1)
+    return;  // no other thread uses it
+
+  push_off();
+  me = cpuid();
+  __sync_synchronize();
+  for(i = 0; i < NCPU; i++){
+    n[i] = __atomic_load_n(&cpus[i].ntrap, __ATOMIC_SEQ_CST);
+    sent[i] = i != me &&
+      __atomic_load_n(&cpus[i].upt, __ATOMIC_SEQ_CST) == pagetable;
+    if(sent[i])
+      ipi(i);
+  }
+  // a CPU in user space takes the IPI at once, so this
+  // cannot wait long even with interrupts off.
+  for(i = 0; i < NCPU; i++){
+    while(sent[i] &&
+          __atomic_load_n(&cpus[i].upt, __ATOMIC_SEQ_CST) == pagetable &&
+          __atomic_load_n(&cpus[i].ntrap, __ATOMIC_SEQ_CST) == n[i])
+      ;
+  }
+  pop_off();
 }
 
 // create an empty user page table.
@@ -293,40 +353,156 @@ uvmfree(pagetable_t pagetable, uint64 sz)
 
 // Given a parent process's page table, copy
 // its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// The child shares the parent's physical pages:
+// writable pages become read-only and copy-on-write
+// in both page tables, and are copied by cowfault()
+// on the first store. Heap pages that were never
+// touched stay unmapped in the child too.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
 uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
+{
+  return uvmcopyrange(old, new, 0, sz, 0);
+}
+
+// Like uvmcopy(), for the pages mapped in [start, end).
+// If shared is set, both page tables map the pages just
+// as old does, without copy-on-write, as for a MAP_SHARED
+// file mapping.
+int
+uvmcopyrange(pagetable_t old, pagetable_t new, uint64 start, uint64 end, int shared)
 {
   pte_t *pte;
   uint64 pa, i;
   uint flags;
-  char *mem;
+  int cow = 0;
 
-  for(i = 0; i < sz; i += PGSIZE){
+  for(i = start; i < end; i += PGSIZE){
     if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
+      continue;
     if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+      continue;
+    if(!shared && (*pte & PTE_W)){
+      *pte = (*pte & ~PTE_W) | PTE_COW;
+      cow = 1;
+    }
     pa = PTE2PA(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
+    if(mappages(new, i, PGSIZE, pa, flags) != 0)
       goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
-      goto err;
-    }
+    kdup((void*)pa);
   }
+  // old's other threads must not keep storing to the pages.
+  if(cow)
+    tlbshootdown(old);
   return 0;
 
  err:
-  uvmunmap(new, 0, i / PGSIZE, 1);
+  if(cow)
+    tlbshootdown(old);
+  uvmunmap(new, start, (i - start) / PGSIZE, 1);
   return -1;
 }
 
+// Resolve a store to the copy-on-write page holding va:
+// give pagetable a private, writable copy of the page, or
+// if no other page table still shares it, just make it
+// writable again.
+// Returns 0 on success, -1 if va is not a copy-on-write
+// page or there is no memory for the copy.
+int
+cowfault(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa;
+  uint flags;
+  char *mem;
+
+  if(va >= MAXVA)
+    return -1;
+  if((pte = walk(pagetable, va, 0)) == 0)
+    return -1;
+  if((*pte & (PTE_V|PTE_U|PTE_COW)) != (PTE_V|PTE_U|PTE_COW))
+    return -1;
+  pa = PTE2PA(*pte);
+  flags = (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+
+  if(krefcnt((void*)pa) == 1){
+    // the other sharers have already copied or exited.
+    *pte = PA2PTE(pa) | flags;
+    return 0;
+  }
+
+  if((mem = kalloc()) == 0)
+    return -1;
+  memmove(mem, (char*)pa, PGSIZE);
+  *pte = PA2PTE(mem) | flags;
+  // other threads must switch to the copy too.
+  tlbshootdown(pagetable);
+  kfree((void*)pa);
+  return 0;
+}
+
+// Make the user page holding va present for access (VMREAD,
+// VMWRITE or VMEXEC), for a page fault or for copyin/copyout.
+// sbrk() only moves p->sz, so a page below sz that has no
+// mapping yet gets a fresh zero page here. A store to a
+// copy-on-write page goes to cowfault(). Faults in an
+// mmap()ed file or a program segment go to mmapfault().
+// Returns the physical address of the page, or 0 if va
+// is not valid user memory for the access or there is no
+// free memory.
+uint64
+vmfault(pagetable_t pagetable, uint64 va, uint64 sz, int access)
+{
+  struct vmtab *vt = myproc()->vmtab;
+  pte_t *pte;
+  char *mem;
+  uint64 pa;
+  int write = access == VMWRITE;
+
+  if(va >= MAXVA)
+    return 0;
+  va = PGROUNDDOWN(va);
+  // threads sharing the page table change it under vt->lock.
+  acquire(&vt->lock);
+  pte = walk(pagetable, va, 0);
+  if(pte == 0 || (*pte & PTE_V) == 0){
+    if(va >= sz || vmalookup(vt, va)){
+      release(&vt->lock);
+      return mmapfault(pagetable, va, access);
+    }
+    if((mem = kalloc()) == 0)
+      goto bad;
+    memset(mem, 0, PGSIZE);
+    if(mappages(pagetable, va, PGSIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U) != 0){
+      kfree(mem);
+      goto bad;
+    }
+    pte = walk(pagetable, va, 0);
+  }
+  if((*pte & PTE_U) == 0)
+    goto bad;
+  if(access == VMEXEC && (*pte & PTE_X) == 0)
+    goto bad;
+  if(write && (*pte & PTE_W) == 0){
+    if((*pte & PTE_COW) == 0){
+      release(&vt->lock);
+      return mmapfault(pagetable, va, access);
+    }
+    if(cowfault(pagetable, va) < 0)
+      goto bad;
+  }
+  pa = PTE2PA(*pte);
+  release(&vt->lock);
+  return pa;
+
+ bad:
+  release(&vt->lock);
+  return 0;
+}
+
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
 void
@@ -342,6 +518,8 @@ uvmclear(pagetable_t pagetable, uint64 va)
 
 // Copy from kernel to user.
 // Copy len bytes from src to virtual address dstva in a given page table.
+// Lazy heap pages are allocated and copy-on-write
+// pages are copied first.
 // Return 0 on success, -1 on error.
 int
 copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
@@ -350,7 +528,7 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = vmfault(pagetable, va0, myproc()->sz, 1);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (dstva - va0);
@@ -375,7 +553,7 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = vmfault(pagetable, va0, myproc()->sz, 0);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
@@ -402,7 +580,7 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = vmfault(pagetable, va0, myproc()->sz, 0);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
@@ -40,6 +40,7 @@ void rinode(uint inum, struct dinode *ip);
 void rsect(uint sec, void *buf);
 uint ialloc(ushort type);
 void iappend(uint inum, void *p, int n);
+void dirwrite(uint inum, struct dirent *de, int n);
 void die(const char *);
 
 // convert to intel byte order
@@ -73,6 +74,8 @@ main(int argc, char *argv[])
   struct dirent de;
   char buf[BSIZE];
   struct dinode din;
+  static struct dirent rootents[NINODES];
+  int nroot = 0;
 
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
@@ -120,12 +123,12 @@ main(int argc, char *argv[])
   bzero(&de, sizeof(de));
   de.inum = xshort(rootino);
   strcpy(de.name, ".");
-  iappend(rootino, &de, sizeof(de));
+  rootents[nroot++] = de;
 
   bzero(&de, sizeof(de));
   de.inum = xshort(rootino);
   strcpy(de.name, "..");
-  iappend(rootino, &de, sizeof(de));
+  rootents[nroot++] = de;
 
   for(i = 2; i < argc; i++){
     // get rid of "user/"
@@ -152,7 +155,8 @@ main(int argc, char *argv[])
     bzero(&de, sizeof(de));
     de.inum = xshort(inum);
     strncpy(de.name, shortname, DIRSIZ);
-    iappend(rootino, &de, sizeof(de));
+    assert(nroot < NINODES);
+    rootents[nroot++] = de;
 
     while((cc = read(fd, buf, sizeof(buf))) > 0)
       iappend(inum, buf, cc);
@@ -160,12 +164,16 @@ main(int argc, char *argv[])
     close(fd);
   }
 
+  dirwrite(rootino, rootents, nroot);
+
   // fix size of root inode dir
   rinode(rootino, &din);
   off = xint(din.size);
-  off = ((off/BSIZE) + 1) * BSIZE;
-  din.size = xint(off);
-  winode(rootino, &din);
+  if(off % BSIZE){
+    off = ((off/BSIZE) + 1) * BSIZE;
+    din.size = xint(off);
+    winode(rootino, &din);
+  }
 
   balloc(freeblock);
 
@@ -249,6 +257,21 @@ balloc(int used)
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// Return entry i of block-map block addr, allocating
+// a block for it if there is none.
+uint
+mapind(uint addr, uint i)
+{
+  uint indirect[NINDIRECT];
+
+  rsect(addr, (char*)indirect);
+  if(indirect[i] == 0){
+    indirect[i] = xint(freeblock++);
+    wsect(addr, (char*)indirect);
+  }
+  return xint(indirect[i]);
+}
+
 void
 iappend(uint inum, void *xp, int n)
 {
@@ -256,7 +279,6 @@ iappend(uint inum, void *xp, int n)
   uint fbn, off, n1;
   struct dinode din;
   char buf[BSIZE];
-  uint indirect[NINDIRECT];
   uint x;
 
   rinode(inum, &din);
@@ -270,16 +292,17 @@ iappend(uint inum, void *xp, int n)
         din.addrs[fbn] = xint(freeblock++);
       }
       x = xint(din.addrs[fbn]);
-    } else {
+    } else if(fbn < NDIRECT + NINDIRECT){
       if(xint(din.addrs[NDIRECT]) == 0){
         din.addrs[NDIRECT] = xint(freeblock++);
       }
-      rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      if(indirect[fbn - NDIRECT] == 0){
-        indirect[fbn - NDIRECT] = xint(freeblock++);
-        wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
+      x = mapind(xint(din.addrs[NDIRECT]), fbn - NDIRECT);
+    } else {
+      if(xint(din.addrs[NDIRECT+1]) == 0){
+        din.addrs[NDIRECT+1] = xint(freeblock++);
       }
-      x = xint(indirect[fbn-NDIRECT]);
+      x = mapind(xint(din.addrs[NDIRECT+1]), (fbn - NDIRECT - NINDIRECT) / NINDIRECT);
+      x = mapind(x, (fbn - NDIRECT - NINDIRECT) % NINDIRECT);
     }
     n1 = min(n, (fbn + 1) * BSIZE - off);
     rsect(x, buf);
@@ -293,6 +316,56 @@ iappend(uint inum, void *xp, int n)
   winode(inum, &din);
 }
 
+// Write the n entries in de[] as the contents of directory inum:
+// flat if they fit in one block, otherwise in the indexed format
+// (see kernel/fs.h), with the smallest global depth at which
+// every bucket fits in one block.
+void
+dirwrite(uint inum, struct dirent *de, int n)
+{
+  ushort h[BSIZE/sizeof(ushort)];
+  struct dirent bucket[DPB];
+  int depth, i, b, nb, cnt, max;
+
+  if(n <= DPB){
+    iappend(inum, de, n * sizeof(struct dirent));
+    return;
+  }
+
+  for(depth = 1; ; depth++){
+    assert(depth <= DIRDEPTH);
+    max = 0;
+    for(b = 0; b < (1 << depth); b++){
+      cnt = 0;
+      for(i = 0; i < n; i++)
+        if((dirhash(de[i].name) & ((1 << depth) - 1)) == b)
+          cnt++;
+      if(cnt > max)
+        max = cnt;
+    }
+    if(max < DPB)
+      break;
+  }
+
+  bzero(h, sizeof(h));
+  h[1] = xshort(DIRMAGIC);
+  h[2] = xshort(depth);
+  for(b = 0; b < (1 << depth); b++)
+    h[DIRTAB(b)] = xshort(1 + b);
+  iappend(inum, h, BSIZE);
+
+  for(b = 0; b < (1 << depth); b++){
+    bzero(bucket, sizeof(bucket));
+    ((ushort*)bucket)[1] = xshort(DIRMAGIC);
+    ((ushort*)bucket)[2] = xshort(depth);
+    nb = 1;
+    for(i = 0; i < n; i++)
+      if((dirhash(de[i].name) & ((1 << depth) - 1)) == b)
+        bucket[nb++] = de[i];
+    iappend(inum, bucket, BSIZE);
+  }
+}
+
 void
 die(const char *s)
 {
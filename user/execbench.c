@@ -0,0 +1,50 @@
+// execbench: the cost of fork() and exec(), in cycles.
+//
+// Runs itself with an argument that makes it exit at once,
+// NRUN times, so every exec() after the first finds the
+// program's text in the page cache.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+#define NRUN 200
+
+static inline uint64
+rdcycle(void)
+{
+  uint64 x;
+  asm volatile("rdcycle %0" : "=r" (x));
+  return x;
+}
+
+int
+main(int argc, char *argv[])
+{
+  char *args[] = { "execbench", "x", 0 };
+  uint64 t0, t;
+  int i, pid, xstatus;
+
+  if(argc > 1)
+    exit(0);
+
+  t0 = rdcycle();
+  for(i = 0; i < NRUN; i++){
+    pid = fork();
+    if(pid < 0){
+      fprintf(2, "execbench: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      exec(args[0], args);
+      fprintf(2, "execbench: exec failed\n");
+      exit(1);
+    }
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(1);
+  }
+  t = rdcycle() - t0;
+  printf("execbench: %d fork+exec+exit: %l cycles each\n", NRUN, t / NRUN);
+  exit(0);
+}
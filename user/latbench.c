@@ -0,0 +1,84 @@
+// latbench: interactive latency under CPU load.
+//
+// Starts nspin CPU-bound processes, then times round trips of
+// a byte between two processes that sleep between messages,
+// as a shell does between commands. It measures once with the
+// spinners at the default priority and once with them moved to
+// the lowest level by setpriority().
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/param.h"
+#include "user/user.h"
+
+#define ROUNDS 20
+
+// time ROUNDS round trips; print the mean and worst case.
+void
+measure(int nspin, char *what)
+{
+  int a[2], b[2], i, t, sum, max;
+  char c = 0;
+
+  if(pipe(a) < 0 || pipe(b) < 0){
+    fprintf(2, "latbench: pipe failed\n");
+    exit(1);
+  }
+  if(fork() == 0){
+    for(i = 0; i < ROUNDS; i++){
+      read(a[0], &c, 1);
+      write(b[1], &c, 1);
+    }
+    exit(0);
+  }
+  sum = max = 0;
+  for(i = 0; i < ROUNDS; i++){
+    sleep(1);
+    t = uptime();
+    write(a[1], &c, 1);
+    read(b[0], &c, 1);
+    t = uptime() - t;
+    sum += t;
+    if(t > max)
+      max = t;
+  }
+  wait(0);
+  close(a[0]);
+  close(a[1]);
+  close(b[0]);
+  close(b[1]);
+  printf("latbench: %d spinners, %s: mean %d.%d%d max %d ticks per round trip\n",
+         nspin, what, sum / ROUNDS, sum * 10 / ROUNDS % 10,
+         sum * 100 / ROUNDS % 10, max);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int nspin, i, pids[NPROC];
+
+  nspin = argc > 1 ? atoi(argv[1]) : 8;
+  if(nspin > NPROC / 2)
+    nspin = NPROC / 2;
+  for(i = 0; i < nspin; i++){
+    if((pids[i] = fork()) < 0){
+      fprintf(2, "latbench: fork failed\n");
+      exit(1);
+    }
+    if(pids[i] == 0){
+      for(;;)
+        ;
+    }
+  }
+
+  measure(nspin, "default priority");
+  for(i = 0; i < nspin; i++)
+    setpriority(pids[i], NPRIO-1);
+  measure(nspin, "spinners lowered");
+
+  for(i = 0; i < nspin; i++){
+    kill(pids[i]);
+    wait(0);
+  }
+  exit(0);
+}
@@ -0,0 +1,92 @@
+// membench: speed of the kernel's memmove() and memset(),
+// in bytes per cycle.
+//
+// read() of a file that is in the buffer cache is mostly the
+// kernel's memmove() from the cached block into the user
+// buffer; a word-aligned buffer gets the word-at-a-time path
+// and a misaligned one the byte path. Touching newly sbrk()ed
+// pages makes the kernel allocate and zero them with memset().
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "kernel/riscv.h"
+#include "user/user.h"
+
+#define FILESZ (32*1024)  // small enough to stay in the buffer cache
+#define ROUNDS 32
+#define NPAGE  256
+
+char buf[FILESZ + 16];
+
+static inline uint64
+rdcycle(void)
+{
+  uint64 x;
+  asm volatile("rdcycle %0" : "=r" (x));
+  return x;
+}
+
+void
+report(char *what, uint64 bytes, uint64 cycles)
+{
+  uint64 r = cycles ? bytes * 100 / cycles : 0;
+
+  printf("membench: %s: %l bytes in %l cycles, %l.%l%l bytes/cycle\n",
+         what, bytes, cycles, r / 100, r / 10 % 10, r % 10);
+}
+
+// read the whole file into p ROUNDS times.
+uint64
+readfile(char *p)
+{
+  uint64 t0;
+  int fd, i;
+
+  t0 = rdcycle();
+  for(i = 0; i < ROUNDS; i++){
+    if((fd = open("membench.tmp", O_RDONLY)) < 0){
+      fprintf(2, "membench: open failed\n");
+      exit(1);
+    }
+    if(read(fd, p, FILESZ) != FILESZ){
+      fprintf(2, "membench: read failed\n");
+      exit(1);
+    }
+    close(fd);
+  }
+  return rdcycle() - t0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  uint64 t0, t;
+  char *p;
+  int fd, i;
+
+  if((fd = open("membench.tmp", O_CREATE|O_RDWR)) < 0 ||
+     write(fd, buf, FILESZ) != FILESZ){
+    fprintf(2, "membench: cannot create membench.tmp\n");
+    exit(1);
+  }
+  close(fd);
+
+  readfile(buf);  // warm the buffer cache
+  t = readfile(buf);
+  report("memmove, aligned", (uint64)FILESZ * ROUNDS, t);
+  t = readfile(buf + 1);
+  report("memmove, misaligned", (uint64)FILESZ * ROUNDS, t);
+  unlink("membench.tmp");
+
+  if((p = sbrk(NPAGE * PGSIZE)) == (char*)-1){
+    fprintf(2, "membench: sbrk failed\n");
+    exit(1);
+  }
+  t0 = rdcycle();
+  for(i = 0; i < NPAGE; i++)
+    p[i * PGSIZE] = 1;
+  t = rdcycle() - t0;
+  report("memset, page faults", (uint64)NPAGE * PGSIZE, t);
+  exit(0);
+}
@@ -0,0 +1,79 @@
+// pipebench: pipe throughput, in bytes per cycle.
+//
+// A child writes TOTAL bytes into a pipe in chunks of each
+// size, and the parent reads them out, with the pipe's ring
+// at its default size and then set to RINGSZ with fcntl().
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+#define TOTAL  (1024*1024)
+#define RINGSZ (64*1024)
+
+char buf[16*1024];
+
+static inline uint64
+rdcycle(void)
+{
+  uint64 x;
+  asm volatile("rdcycle %0" : "=r" (x));
+  return x;
+}
+
+// move TOTAL bytes through a pipe in chunks of n bytes.
+// returns the cycles taken.
+uint64
+run(int n, int ringsz)
+{
+  int fds[2], i, m;
+  uint64 t0;
+
+  if(pipe(fds) < 0){
+    fprintf(2, "pipebench: pipe failed\n");
+    exit(1);
+  }
+  if(ringsz && fcntl(fds[1], F_SETPIPE_SZ, ringsz) < 0){
+    fprintf(2, "pipebench: F_SETPIPE_SZ failed\n");
+    exit(1);
+  }
+
+  t0 = rdcycle();
+  if(fork() == 0){
+    close(fds[0]);
+    for(i = 0; i < TOTAL; i += n)
+      if(write(fds[1], buf, n) != n){
+        fprintf(2, "pipebench: write failed\n");
+        exit(1);
+      }
+    exit(0);
+  }
+  close(fds[1]);
+  for(i = 0; (m = read(fds[0], buf, sizeof(buf))) > 0; i += m)
+    ;
+  close(fds[0]);
+  wait(0);
+  if(i != TOTAL){
+    fprintf(2, "pipebench: read %d bytes, expected %d\n", i, TOTAL);
+    exit(1);
+  }
+  return rdcycle() - t0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int sizes[] = { 64, 512, 4096, 16*1024 };
+  uint64 t, r;
+
+  for(int ring = 0; ring < 2; ring++){
+    for(int i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++){
+      t = run(sizes[i], ring ? RINGSZ : 0);
+      r = t ? (uint64)TOTAL * 100 / t : 0;
+      printf("pipebench: %s ring, %d-byte writes: %l cycles, %l.%l%l bytes/cycle\n",
+             ring ? "64K" : "default", sizes[i], t, r / 100, r / 10 % 10, r % 10);
+    }
+  }
+  exit(0);
+}
@@ -0,0 +1,64 @@
+// schedbench: scheduler throughput as load grows.
+//
+// For n = 1, 2, ... pairs, each pair of processes bounces a
+// byte back and forth through two pipes, so that every round
+// trip costs two sleeps, two wakeups and two context switches.
+// Run it under make CPUS=1 through CPUS=8 to see how the
+// throughput scales with the number of harts.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+#define ROUNDS 2000   // round trips per pair
+
+void
+pingpong(void)
+{
+  int a[2], b[2], i;
+  char c = 0;
+
+  if(pipe(a) < 0 || pipe(b) < 0){
+    fprintf(2, "schedbench: pipe failed\n");
+    exit(1);
+  }
+  if(fork() == 0){
+    for(i = 0; i < ROUNDS; i++){
+      read(a[0], &c, 1);
+      write(b[1], &c, 1);
+    }
+    exit(0);
+  }
+  for(i = 0; i < ROUNDS; i++){
+    write(a[1], &c, 1);
+    read(b[0], &c, 1);
+  }
+  wait(0);
+  exit(0);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int n, i, maxpairs, t;
+
+  maxpairs = argc > 1 ? atoi(argv[1]) : 8;
+  for(n = 1; n <= maxpairs; n++){
+    t = uptime();
+    for(i = 0; i < n; i++){
+      int pid = fork();
+      if(pid < 0){
+        fprintf(2, "schedbench: fork failed\n");
+        exit(1);
+      }
+      if(pid == 0)
+        pingpong();
+    }
+    for(i = 0; i < n; i++)
+      wait(0);
+    t = uptime() - t;
+    printf("schedbench: %d pairs: %d round trips in %d ticks (%d per 100 ticks)\n",
+           n, n * ROUNDS, t, t ? n * ROUNDS * 100 / t : 0);
+  }
+  exit(0);
+}
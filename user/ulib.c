@@ -1,6 +1,7 @@
 #include "kernel/types.h"
 #include "kernel/stat.h"
 #include "kernel/fcntl.h"
+#include "kernel/futex.h"
 #include "user/user.h"
 
 char*
@@ -134,3 +135,180 @@ memcpy(void *dst, const void *src, uint n)
 {
   return memmove(dst, src, n);
 }
+
+// Threads.
+//
+// thread_create() runs fn(arg) in a new thread, on a stack
+// from malloc(); the thread exits when fn returns.
+// thread_join() waits for it and frees the stack. malloc()
+// is not thread-safe, so only one thread at a time should
+// create or join threads.
+
+#define TSTACK  8192
+#define NTHREAD 64
+
+struct tstart {
+  void (*fn)(void*);
+  void *arg;
+};
+
+static struct {
+  int tid;
+  void *stack;
+} threads[NTHREAD];
+
+static void
+thread_start(void *a)
+{
+  struct tstart *ts = a;
+
+  ts->fn(ts->arg);
+  exit(0);
+}
+
+int
+thread_create(void (*fn)(void*), void *arg)
+{
+  struct tstart *ts;
+  char *stack;
+  int i, tid;
+
+  for(i = 0; i < NTHREAD && threads[i].stack; i++)
+    ;
+  if(i == NTHREAD || (stack = malloc(TSTACK)) == 0)
+    return -1;
+  // the start record sits at the top of the stack.
+  ts = (struct tstart*)(stack + TSTACK) - 1;
+  ts->fn = fn;
+  ts->arg = arg;
+  if((tid = clone(thread_start, ts, ts)) < 0){
+    free(stack);
+    return -1;
+  }
+  threads[i].tid = tid;
+  threads[i].stack = stack;
+  return tid;
+}
+
+int
+thread_join(int tid)
+{
+  int i;
+
+  for(i = 0; i < NTHREAD; i++)
+    if(threads[i].stack && threads[i].tid == tid)
+      break;
+  if(i == NTHREAD || join(tid) != tid)
+    return -1;
+  free(threads[i].stack);
+  threads[i].stack = 0;
+  return 0;
+}
+
+// Mutexes, condition variables and semaphores.
+//
+// Each is a word (or two) in user memory, updated with atomic
+// instructions; the kernel is entered through futex() only to
+// sleep, or to wake sleepers, so uncontended use never makes a
+// system call. The mutex is Drepper's: a mutex that may have
+// sleepers is marked 2, and only unlocking one of those wakes.
+
+void
+mutex_init(struct mutex *m)
+{
+  m->v = 0;
+}
+
+void
+mutex_lock(struct mutex *m)
+{
+  int c;
+
+  if((c = __sync_val_compare_and_swap(&m->v, 0, 1)) == 0)
+    return;
+  if(c != 2)
+    c = __atomic_exchange_n(&m->v, 2, __ATOMIC_SEQ_CST);
+  while(c != 0){
+    futex(&m->v, FUTEX_WAIT, 2);
+    c = __atomic_exchange_n(&m->v, 2, __ATOMIC_SEQ_CST);
+  }
+}
+
+void
+mutex_unlock(struct mutex *m)
+{
+  if(__atomic_exchange_n(&m->v, 0, __ATOMIC_SEQ_CST) == 2)
+    futex(&m->v, FUTEX_WAKE, 1);
+}
+
+void
+cond_init(struct cond *c)
+{
+  c->seq = 0;
+  c->waiters = 0;
+}
+
+// Caller must hold m. A FUTEX_WAIT that starts after a
+// signal has bumped c->seq returns at once, so a signal
+// between unlocking m and sleeping is not lost.
+void
+cond_wait(struct cond *c, struct mutex *m)
+{
+  int seq;
+
+  __atomic_add_fetch(&c->waiters, 1, __ATOMIC_SEQ_CST);
+  seq = __atomic_load_n(&c->seq, __ATOMIC_SEQ_CST);
+  mutex_unlock(m);
+  futex(&c->seq, FUTEX_WAIT, seq);
+  __atomic_sub_fetch(&c->waiters, 1, __ATOMIC_SEQ_CST);
+  mutex_lock(m);
+}
+
+void
+cond_signal(struct cond *c)
+{
+  __atomic_add_fetch(&c->seq, 1, __ATOMIC_SEQ_CST);
+  if(__atomic_load_n(&c->waiters, __ATOMIC_SEQ_CST) > 0)
+    futex(&c->seq, FUTEX_WAKE, 1);
+}
+
+void
+cond_broadcast(struct cond *c)
+{
+  __atomic_add_fetch(&c->seq, 1, __ATOMIC_SEQ_CST);
+  if(__atomic_load_n(&c->waiters, __ATOMIC_SEQ_CST) > 0)
+    futex(&c->seq, FUTEX_WAKE, -1);
+}
+
+void
+sem_init(struct sem *s, int n)
+{
+  s->count = n;
+  s->waiters = 0;
+}
+
+void
+sem_wait(struct sem *s)
+{
+  int c;
+
+  for(;;){
+    c = __atomic_load_n(&s->count, __ATOMIC_SEQ_CST);
+    if(c > 0){
+      if(__sync_bool_compare_and_swap(&s->count, c, c - 1))
+        return;
+      continue;
+    }
+    __atomic_add_fetch(&s->waiters, 1, __ATOMIC_SEQ_CST);
+    futex(&s->count, FUTEX_WAIT, 0);
+    __atomic_sub_fetch(&s->waiters, 1, __ATOMIC_SEQ_CST);
+  }
+}
+
+void
+sem_post(struct sem *s)
+{
+  __atomic_add_fetch(&s->count, 1, __ATOMIC_SEQ_CST);
+  if(__atomic_load_n(&s->waiters, __ATOMIC_SEQ_CST) > 0)
+    futex(&s->count, FUTEX_WAKE, 1);
+}
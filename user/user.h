@@ -1,6 +1,19 @@
 struct stat;
 struct rtcdate;
 
+// synchronization for threads, in ulib.c.
+struct mutex {
+  int v;         // 0 unlocked, 1 locked, 2 locked with waiters
+};
+struct cond {
+  int seq;       // bumped by each signal
+  int waiters;
+};
+struct sem {
+  int count;
+  int waiters;
+};
+
 // system calls
 int fork(void);
 int exit(int) __attribute__((noreturn));
@@ -23,6 +36,15 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+int setpriority(int, int);
+int clone(void (*)(void*), void*, void*);
+int join(int);
+int futex(int*, int, int);
+int fcntl(int, int, int);
+int splice(int, int, int);
+int tee(int, int, int);
+void *mmap(void*, int, int, int, int, int);
+int munmap(void*, int);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -40,3 +62,15 @@ void free(void*);
 int atoi(const char*);
 int memcmp(const void *, const void *, uint);
 void *memcpy(void *, const void *, uint);
+int thread_create(void (*)(void*), void*);
+int thread_join(int);
+void mutex_init(struct mutex*);
+void mutex_lock(struct mutex*);
+void mutex_unlock(struct mutex*);
+void cond_init(struct cond*);
+void cond_wait(struct cond*, struct mutex*);
+void cond_signal(struct cond*);
+void cond_broadcast(struct cond*);
+void sem_init(struct sem*, int);
+void sem_wait(struct sem*);
+void sem_post(struct sem*);
@@ -4,6 +4,7 @@
 #include "user/user.h"
 #include "kernel/fs.h"
 #include "kernel/fcntl.h"
+#include "kernel/futex.h"
 #include "kernel/syscall.h"
 #include "kernel/memlayout.h"
 #include "kernel/riscv.h"
@@ -569,9 +570,12 @@ writetest(char *s)
   }
 }
 
+// write a file that needs the double-indirect block,
+// a few megabytes long.
 void
 writebig(char *s)
 {
+  enum { NBLOCK = 6*1024 };
   int i, fd, n;
 
   fd = open("big", O_CREATE|O_RDWR);
@@ -580,7 +584,7 @@ writebig(char *s)
     exit(1);
   }
 
-  for(i = 0; i < MAXFILE; i++){
+  for(i = 0; i < NBLOCK; i++){
     ((int*)buf)[0] = i;
     if(write(fd, buf, BSIZE) != BSIZE){
       printf("%s: error: write big file failed\n", s, i);
@@ -600,7 +604,7 @@ writebig(char *s)
   for(;;){
     i = read(fd, buf, BSIZE);
     if(i == 0){
-      if(n == MAXFILE - 1){
+      if(n != NBLOCK){
         printf("%s: read only %d blocks from big", s, n);
         exit(1);
       }
@@ -779,90 +783,849 @@ pipe1(char *s)
   }
 }
 
+// F_SETPIPE_SZ lets a writer get further ahead of its
+// reader, and unread data survives the ring being resized.
+void
+pipesize(char *s)
+{
+  int fds[2], i, n;
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  if(fcntl(fds[0], F_GETPIPE_SZ, 0) < 512){
+    printf("%s: F_GETPIPE_SZ failed\n", s);
+    exit(1);
+  }
+  if(fcntl(fds[1], F_SETPIPE_SZ, 5000) != 8192){
+    printf("%s: F_SETPIPE_SZ 5000 did not give 8192\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 8192; i++)
+    buf[i] = i * 7;
+  if(write(fds[1], buf, 8192) != 8192){
+    printf("%s: write to resized pipe failed\n", s);
+    exit(1);
+  }
+  if(fcntl(fds[1], F_SETPIPE_SZ, 4096) != -1){
+    printf("%s: shrank a pipe below its unread data\n", s);
+    exit(1);
+  }
+  if(fcntl(fds[1], F_SETPIPE_SZ, 1 << 30) != -1){
+    printf("%s: F_SETPIPE_SZ allowed 1 GB\n", s);
+    exit(1);
+  }
+  if(fcntl(fds[0], F_SETPIPE_SZ, 65536) != 65536){
+    printf("%s: F_SETPIPE_SZ 65536 failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 8192; i++)
+    buf[i] = (i + 8192) * 7;
+  if(write(fds[1], buf, 8192) != 8192){
+    printf("%s: write after growing failed\n", s);
+    exit(1);
+  }
+  close(fds[1]);
+  for(i = 0; (n = read(fds[0], buf, 3000)) > 0; i += n){
+    for(int j = 0; j < n; j++){
+      if(buf[j] != (char)((i + j) * 7)){
+        printf("%s: wrong byte at %d\n", s, i + j);
+        exit(1);
+      }
+    }
+  }
+  if(i != 16384){
+    printf("%s: read %d bytes, expected 16384\n", s, i);
+    exit(1);
+  }
+  close(fds[0]);
+}
+
+// splice() a file into a pipe, tee() it into a second
+// pipe, and splice() the first pipe out to another file.
+void
+splicetest(char *s)
+{
+  int fd, fd2, p1[2], p2[2], i, n;
+  enum { N = 5000 };
+
+  unlink("splicein");
+  unlink("spliceout");
+  if((fd = open("splicein", O_CREATE|O_RDWR)) < 0){
+    printf("%s: create splicein failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++)
+    buf[i] = i * 3;
+  if(write(fd, buf, N) != N){
+    printf("%s: write splicein failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if((fd = open("splicein", O_RDONLY)) < 0 ||
+     (fd2 = open("spliceout", O_CREATE|O_RDWR)) < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  if(splice(fd, fd2, 10) != -1){
+    printf("%s: splice between two files worked\n", s);
+    exit(1);
+  }
+  if(pipe(p1) < 0 || pipe(p2) < 0 ||
+     fcntl(p1[1], F_SETPIPE_SZ, 8192) < 0 || fcntl(p2[1], F_SETPIPE_SZ, 8192) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+
+  for(i = 0; i < N; i += n){
+    if((n = splice(fd, p1[1], N - i)) <= 0){
+      printf("%s: splice in returned %d\n", s, n);
+      exit(1);
+    }
+  }
+  if(splice(fd, p1[1], 1) != 0){
+    printf("%s: splice past end of file\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i += n){
+    if((n = tee(p1[0], p2[1], N - i)) <= 0){
+      printf("%s: tee returned %d\n", s, n);
+      exit(1);
+    }
+  }
+  close(p1[1]);
+  close(p2[1]);
+  for(i = 0; (n = splice(p1[0], fd2, N)) > 0; i += n)
+    ;
+  if(i != N){
+    printf("%s: spliced out %d bytes, expected %d\n", s, i, N);
+    exit(1);
+  }
+  close(fd);
+  close(fd2);
+  close(p1[0]);
+
+  for(i = 0; (n = read(p2[0], buf + i, N - i)) > 0; i += n)
+    ;
+  close(p2[0]);
+  for(i = 0; i < N; i++){
+    if(buf[i] != (char)(i * 3)){
+      printf("%s: tee copy wrong at %d\n", s, i);
+      exit(1);
+    }
+  }
+  if((fd = open("spliceout", O_RDONLY)) < 0 || read(fd, buf, N + 1) != N){
+    printf("%s: spliceout has the wrong size\n", s);
+    exit(1);
+  }
+  close(fd);
+  for(i = 0; i < N; i++){
+    if(buf[i] != (char)(i * 3)){
+      printf("%s: spliceout wrong at %d\n", s, i);
+      exit(1);
+    }
+  }
+  unlink("splicein");
+  unlink("spliceout");
+}
+
+// two tee()s in opposite directions between full pipes
+// must not keep readers of either pipe waiting.
+void
+teecross(char *s)
+{
+  int a[2], b[2], pids[2], i, n, size, xstatus;
+
+  if(pipe(a) < 0 || pipe(b) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  size = fcntl(a[0], F_GETPIPE_SZ, 0);
+  memset(buf, 'x', size);
+  if(write(a[1], buf, size) != size || write(b[1], buf, size) != size){
+    printf("%s: fill failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 2; i++){
+    pids[i] = fork();
+    if(pids[i] < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pids[i] == 0){
+      if(i == 0)
+        n = tee(a[0], b[1], 1);
+      else
+        n = tee(b[0], a[1], 1);
+      exit(n == 1 ? 0 : 1);
+    }
+  }
+  sleep(2);
+  for(i = 0; i < size; i += n){
+    if((n = read(a[0], buf, size - i)) <= 0){
+      printf("%s: read a failed\n", s);
+      exit(1);
+    }
+  }
+  for(i = 0; i < size; i += n){
+    if((n = read(b[0], buf, size - i)) <= 0){
+      printf("%s: read b failed\n", s);
+      exit(1);
+    }
+  }
+  for(i = 0; i < 2; i++){
+    wait(&xstatus);
+    if(xstatus != 0){
+      printf("%s: tee failed\n", s);
+      exit(1);
+    }
+  }
+  close(a[0]);
+  close(a[1]);
+  close(b[0]);
+  close(b[1]);
+}
+
+// mmap() a file MAP_PRIVATE and then MAP_SHARED. stores to
+// the shared mapping, including a fork()ed child's, reach
+// the file; stores to the private one do not.
+void
+mmaptest(char *s)
+{
+  int fd, i, xstatus;
+  char *p;
+  enum { N = 2*4096 + 1000 };
+
+  unlink("mmapfile");
+  if((fd = open("mmapfile", O_CREATE|O_RDWR)) < 0){
+    printf("%s: create mmapfile failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++)
+    buf[i] = i % 251;
+  if(write(fd, buf, N) != N){
+    printf("%s: write mmapfile failed\n", s);
+    exit(1);
+  }
+
+  p = mmap(0, N, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(p == (char*)-1){
+    printf("%s: mmap MAP_PRIVATE failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    if(p[i] != (char)(i % 251)){
+      printf("%s: mapped byte %d wrong\n", s, i);
+      exit(1);
+    }
+  }
+  for(i = N; i < 3*4096; i++){
+    if(p[i] != 0){
+      printf("%s: byte %d past end of file not zero\n", s, i);
+      exit(1);
+    }
+  }
+  p[0] = 'x';
+  if(munmap(p, N) != 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+
+  p = mmap(0, N, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(p == (char*)-1){
+    printf("%s: mmap MAP_SHARED failed\n", s);
+    exit(1);
+  }
+  if(p[0] != 0){
+    printf("%s: private store reached the file\n", s);
+    exit(1);
+  }
+  p[1] = 'y';
+  if(fork() == 0){
+    p[2] = 'z';
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0 || p[2] != 'z'){
+    printf("%s: child's store not shared\n", s);
+    exit(1);
+  }
+  if(munmap(p + 4096, 4096) != 0 || munmap(p, N) != 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  if((fd = open("mmapfile", O_RDONLY)) < 0 || read(fd, buf, N + 1) != N){
+    printf("%s: mmapfile has the wrong size\n", s);
+    exit(1);
+  }
+  if(buf[1] != 'y' || buf[2] != 'z' || buf[N-1] != (char)((N-1) % 251)){
+    printf("%s: shared stores not written back\n", s);
+    exit(1);
+  }
+  if(mmap(0, N, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0) != (char*)-1){
+    printf("%s: writable MAP_SHARED of a read-only fd\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("mmapfile");
+}
+
+// unmapping the front of a mapping must not let the
+// partial page at its end read file bytes past its length.
+void
+munmapfront(char *s)
+{
+  int fd, i;
+  char *p;
+  enum { N = 2*4096 + 100 };
+
+  unlink("mmapfile");
+  if((fd = open("mmapfile", O_CREATE|O_RDWR)) < 0){
+    printf("%s: create mmapfile failed\n", s);
+    exit(1);
+  }
+  memset(buf, 'a', 3*4096);
+  if(write(fd, buf, 3*4096) != 3*4096){
+    printf("%s: write mmapfile failed\n", s);
+    exit(1);
+  }
+  p = mmap(0, N, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(p == (char*)-1){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  if(munmap(p, 4096) < 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+  for(i = 4096; i < 3*4096; i++){
+    if(p[i] != (i < N ? 'a' : 0)){
+      printf("%s: byte %d is %d after munmap\n", s, i, p[i]);
+      exit(1);
+    }
+  }
+  munmap(p + 4096, 2*4096);
+  close(fd);
+  unlink("mmapfile");
+}
+
+// MAP_SHARED mappings of one file, made separately, share
+// its pages with each other and with read() and write(),
+// before any munmap(), and a futex in them wakes across them.
+void
+mmapshared(char *s)
+{
+  int fd, pid, xstatus;
+  int *p, *q;
+  char c;
+
+  unlink("mmapfile");
+  if((fd = open("mmapfile", O_CREATE|O_RDWR)) < 0){
+    printf("%s: create mmapfile failed\n", s);
+    exit(1);
+  }
+  memset(buf, 0, 4096);
+  if(write(fd, buf, 4096) != 4096){
+    printf("%s: write mmapfile failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    fd = open("mmapfile", O_RDWR);
+    q = mmap(0, 4096, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if(q == (int*)-1)
+      exit(1);
+    while(q[0] == 0)
+      futex(&q[0], FUTEX_WAIT, 0);
+    q[1] = 'c';
+    exit(0);
+  }
+
+  fd = open("mmapfile", O_RDWR);
+  p = mmap(0, 4096, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(p == (int*)-1){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  sleep(1);
+  p[0] = 1;
+  futex(&p[0], FUTEX_WAKE, 1);
+  wait(&xstatus);
+  if(xstatus != 0 || p[1] != 'c'){
+    printf("%s: child's store not seen\n", s);
+    exit(1);
+  }
+  if(read(fd, &c, 1) != 1 || c != 1){
+    printf("%s: read() missed a store\n", s);
+    exit(1);
+  }
+  c = 'w';
+  if(write(fd, &c, 1) != 1 || ((char*)p)[1] != 'w'){
+    printf("%s: mapping missed a write()\n", s);
+    exit(1);
+  }
+  munmap(p, 4096);
+  close(fd);
+  unlink("mmapfile");
+}
+
+// exec() maps program text read-only, so that
+// processes can share it; a store must kill the process.
+void
+textwrite(char *s)
+{
+  int pid, xstatus;
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    volatile int *addr = (int *) textwrite;
+    *addr = 10;
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != -1){
+    printf("%s: store to text did not fault\n", s);
+    exit(1);
+  }
+}
+
+// exec() reads program text in as it is first executed;
+// run usertests itself, whose text spans many pages, on
+// one quick test.
+void
+exectext(char *s)
+{
+  char *args[] = { "usertests", "textwrite", 0 };
+  struct stat st;
+  int pid, fd, xstatus;
+
+  if(stat("usertests", &st) < 0 || st.size < 8*4096){
+    printf("%s: usertests is not several pages\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    close(1);
+    fd = open("exectext.out", O_CREATE|O_WRONLY);
+    if(fd != 1)
+      exit(1);
+    exec("usertests", args);
+    exit(2);
+  }
+  wait(&xstatus);
+  unlink("exectext.out");
+  if(xstatus != 0){
+    printf("%s: exec'd usertests exited %d\n", s, xstatus);
+    exit(1);
+  }
+}
+
+// reads are served from the page cache; check that it
+// sees writes, including ones that span pages, and
+// truncation.
+void
+pcachetest(char *s)
+{
+  enum { N = 3*4096 };
+  char *buf;
+  int fd, i;
+
+  buf = malloc(N);
+  for(i = 0; i < N; i++)
+    buf[i] = i % 251;
+  fd = open("pcfile", O_CREATE|O_RDWR);
+  if(fd < 0 || write(fd, buf, N) != N){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  // fill the cache, then write across a page boundary.
+  fd = open("pcfile", O_RDWR);
+  if(read(fd, buf, N) != N){
+    printf("%s: read failed\n", s);
+    exit(1);
+  }
+  for(i = 4000; i < 4200; i++)
+    buf[i] = 'x';
+  close(fd);
+  fd = open("pcfile", O_RDWR);
+  if(read(fd, buf, 4000) != 4000 || write(fd, buf + 4000, 200) != 200){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open("pcfile", O_RDONLY);
+  memset(buf, 0, N);
+  if(read(fd, buf, N) != N){
+    printf("%s: reread failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  for(i = 0; i < N; i++){
+    if(buf[i] != (char)(i >= 4000 && i < 4200 ? 'x' : i % 251)){
+      printf("%s: byte %d is %d after write\n", s, i, buf[i]);
+      exit(1);
+    }
+  }
+
+  // truncate and rewrite a shorter file.
+  fd = open("pcfile", O_RDWR|O_TRUNC);
+  if(fd < 0 || write(fd, "abc", 3) != 3){
+    printf("%s: truncate failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  fd = open("pcfile", O_RDONLY);
+  i = read(fd, buf, N);
+  close(fd);
+  if(i != 3 || buf[0] != 'a' || buf[2] != 'c'){
+    printf("%s: read %d bytes after truncate\n", s, i);
+    exit(1);
+  }
+  unlink("pcfile");
+  free(buf);
+}
+
 
 // test if child is killed (status = -1)
 void
-killstatus(char *s)
+killstatus(char *s)
+{
+  int xst;
+  
+  for(int i = 0; i < 100; i++){
+    int pid1 = fork();
+    if(pid1 < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid1 == 0){
+      while(1) {
+        getpid();
+      }
+      exit(0);
+    }
+    sleep(1);
+    kill(pid1);
+    wait(&xst);
+    if(xst != -1) {
+       printf("%s: status should be -1\n", s);
+       exit(1);
+    }
+  }
+  exit(0);
+}
+
+// meant to be run w/ at most two CPUs
+void
+preempt(char *s)
+{
+  int pid1, pid2, pid3;
+  int pfds[2];
+
+  pid1 = fork();
+  if(pid1 < 0) {
+    printf("%s: fork failed", s);
+    exit(1);
+  }
+  if(pid1 == 0)
+    for(;;)
+      ;
+
+  pid2 = fork();
+  if(pid2 < 0) {
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid2 == 0)
+    for(;;)
+      ;
+
+  pipe(pfds);
+  pid3 = fork();
+  if(pid3 < 0) {
+     printf("%s: fork failed\n", s);
+     exit(1);
+  }
+  if(pid3 == 0){
+    close(pfds[0]);
+    if(write(pfds[1], "x", 1) != 1)
+      printf("%s: preempt write error", s);
+    close(pfds[1]);
+    for(;;)
+      ;
+  }
+
+  close(pfds[1]);
+  if(read(pfds[0], buf, sizeof(buf)) != 1){
+    printf("%s: preempt read error", s);
+    return;
+  }
+  close(pfds[0]);
+  printf("kill... ");
+  kill(pid1);
+  kill(pid2);
+  kill(pid3);
+  printf("wait... ");
+  wait(0);
+  wait(0);
+  wait(0);
+}
+
+// kill a child that is blocked reading a pipe: it should exit
+// at once with status -1, and a second kill should fail.
+void
+killsleep(char *s)
+{
+  int fds[2], pid, xstatus, t0;
+  char c;
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    read(fds[0], &c, 1);
+    exit(0);
+  }
+  sleep(1);
+  t0 = uptime();
+  if(kill(pid) != 0){
+    printf("%s: kill failed\n", s);
+    exit(1);
+  }
+  if(wait(&xstatus) != pid || xstatus != -1){
+    printf("%s: wrong wait status %d\n", s, xstatus);
+    exit(1);
+  }
+  if(uptime() - t0 > 5){
+    printf("%s: killed child took too long to exit\n", s);
+    exit(1);
+  }
+  if(kill(pid) != -1){
+    printf("%s: killed a reaped process\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+}
+
+// threads made by thread_create() share memory with
+// their creator and each other.
+int threadcount[4];
+int *threadheap;
+
+void
+threadfn(void *arg)
+{
+  int i = (int)(uint64)arg;
+
+  for(int j = 0; j < 1000; j++)
+    threadcount[i]++;
+  threadheap[i] = i + 1;
+}
+
+void
+threads(char *s)
+{
+  int i, tids[4];
+
+  threadheap = malloc(4 * sizeof(int));
+  for(i = 0; i < 4; i++){
+    threadcount[i] = 0;
+    threadheap[i] = 0;
+  }
+  for(i = 0; i < 4; i++){
+    if((tids[i] = thread_create(threadfn, (void*)(uint64)i)) < 0){
+      printf("%s: thread_create failed\n", s);
+      exit(1);
+    }
+  }
+  for(i = 0; i < 4; i++){
+    if(thread_join(tids[i]) != 0){
+      printf("%s: thread_join failed\n", s);
+      exit(1);
+    }
+  }
+  for(i = 0; i < 4; i++){
+    if(threadcount[i] != 1000 || threadheap[i] != i + 1){
+      printf("%s: thread %d's writes not visible\n", s, i);
+      exit(1);
+    }
+  }
+  if(join(tids[0]) != -1){
+    printf("%s: joined a thread twice\n", s);
+    exit(1);
+  }
+  free(threadheap);
+}
+
+// mutex_lock() must serialize threads' increments, and
+// sem_wait() must block until a matching sem_post().
+struct mutex locktestmu;
+struct sem locktestsem;
+int locktestn;
+
+void
+locktestfn(void *arg)
+{
+  for(int i = 0; i < 1000; i++){
+    mutex_lock(&locktestmu);
+    locktestn++;
+    mutex_unlock(&locktestmu);
+  }
+  sem_post(&locktestsem);
+}
+
+void
+threadlock(char *s)
 {
-  int xst;
-  
-  for(int i = 0; i < 100; i++){
-    int pid1 = fork();
-    if(pid1 < 0){
-      printf("%s: fork failed\n", s);
+  int i, tids[4];
+
+  mutex_init(&locktestmu);
+  sem_init(&locktestsem, 0);
+  locktestn = 0;
+  for(i = 0; i < 4; i++){
+    if((tids[i] = thread_create(locktestfn, 0)) < 0){
+      printf("%s: thread_create failed\n", s);
       exit(1);
     }
-    if(pid1 == 0){
-      while(1) {
-        getpid();
-      }
-      exit(0);
-    }
-    sleep(1);
-    kill(pid1);
-    wait(&xst);
-    if(xst != -1) {
-       printf("%s: status should be -1\n", s);
-       exit(1);
-    }
   }
-  exit(0);
+  for(i = 0; i < 4; i++)
+    sem_wait(&locktestsem);
+  mutex_lock(&locktestmu);
+  if(locktestn != 4000){
+    printf("%s: counted %d, expected 4000\n", s, locktestn);
+    exit(1);
+  }
+  mutex_unlock(&locktestmu);
+  for(i = 0; i < 4; i++)
+    thread_join(tids[i]);
+  if(futex(&locktestn, FUTEX_WAIT, 0) != -1){
+    printf("%s: futex wait on changed word slept\n", s);
+    exit(1);
+  }
 }
 
-// meant to be run w/ at most two CPUs
+// threads share mmap()ed regions: the others see one
+// that a thread maps, and the last to exit unmaps it and
+// writes it back, though it never mapped it itself.
+char *threadmap;
+
 void
-preempt(char *s)
+threadmapfn(void *arg)
 {
-  int pid1, pid2, pid3;
-  int pfds[2];
+  threadmap = mmap(0, 4096, PROT_READ|PROT_WRITE, MAP_SHARED, (int)(uint64)arg, 0);
+  if(threadmap != (char*)-1)
+    threadmap[0] = 'T';
+}
 
-  pid1 = fork();
-  if(pid1 < 0) {
-    printf("%s: fork failed", s);
+void
+threadmmap(char *s)
+{
+  int fd, pid, tid, xstatus;
+  char c[2];
+
+  unlink("tmapfile");
+  if((fd = open("tmapfile", O_CREATE|O_RDWR)) < 0){
+    printf("%s: create tmapfile failed\n", s);
     exit(1);
   }
-  if(pid1 == 0)
-    for(;;)
-      ;
-
-  pid2 = fork();
-  if(pid2 < 0) {
+  memset(buf, 0, 4096);
+  if(write(fd, buf, 4096) != 4096){
+    printf("%s: write tmapfile failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
     printf("%s: fork failed\n", s);
     exit(1);
   }
-  if(pid2 == 0)
-    for(;;)
-      ;
-
-  pipe(pfds);
-  pid3 = fork();
-  if(pid3 < 0) {
-     printf("%s: fork failed\n", s);
-     exit(1);
+  if(pid == 0){
+    if((tid = thread_create(threadmapfn, (void*)(uint64)fd)) < 0)
+      exit(1);
+    thread_join(tid);
+    if(threadmap == (char*)-1 || threadmap[0] != 'T')
+      exit(1);
+    threadmap[1] = 'M';
+    exit(0);
   }
-  if(pid3 == 0){
-    close(pfds[0]);
-    if(write(pfds[1], "x", 1) != 1)
-      printf("%s: preempt write error", s);
-    close(pfds[1]);
-    for(;;)
-      ;
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: thread's mapping not shared\n", s);
+    exit(1);
+  }
+  close(fd);
+  fd = open("tmapfile", O_RDONLY);
+  if(read(fd, c, 2) != 2 || c[0] != 'T' || c[1] != 'M'){
+    printf("%s: stores not written back\n", s);
+    exit(1);
   }
+  close(fd);
+  unlink("tmapfile");
+}
 
-  close(pfds[1]);
-  if(read(pfds[0], buf, sizeof(buf)) != 1){
-    printf("%s: preempt read error", s);
-    return;
+// a fork() while a thread waits makes the futex word's page
+// copy-on-write, so the next store moves the word to a new
+// page; FUTEX_WAKE must still find the waiter.
+int forkfutex;
+
+void
+forkfutexfn(void *arg)
+{
+  while(forkfutex == 0)
+    futex(&forkfutex, FUTEX_WAIT, 0);
+}
+
+void
+futexfork(char *s)
+{
+  int pid, tid;
+
+  forkfutex = 0;
+  if((tid = thread_create(forkfutexfn, 0)) < 0){
+    printf("%s: thread_create failed\n", s);
+    exit(1);
   }
-  close(pfds[0]);
-  printf("kill... ");
-  kill(pid1);
-  kill(pid2);
-  kill(pid3);
-  printf("wait... ");
-  wait(0);
-  wait(0);
+  sleep(2);
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0)
+    exit(0);
   wait(0);
+  forkfutex = 1;
+  if(futex(&forkfutex, FUTEX_WAKE, 1) != 1){
+    printf("%s: waiter not woken after fork\n", s);
+    exit(1);
+  }
+  thread_join(tid);
 }
 
 // try to find any races between exit and wait
@@ -1553,6 +2316,126 @@ bigdir(char *s)
   }
 }
 
+// a directory large enough to switch to the indexed format
+// must still read as plain dirents, find every entry, and be
+// removable once emptied.
+void
+dirindex(char *s)
+{
+  enum { N = 150 };
+  int i, fd, n;
+  char name[10];
+  struct dirent de;
+
+  if(mkdir("dx") != 0){
+    printf("%s: mkdir dx failed\n", s);
+    exit(1);
+  }
+  name[0] = 'd';
+  name[1] = 'x';
+  name[2] = '/';
+  name[6] = '\0';
+  for(i = 0; i < N; i++){
+    name[3] = 'a' + i / 100;
+    name[4] = '0' + (i / 10) % 10;
+    name[5] = '0' + i % 10;
+    if((fd = open(name, O_CREATE|O_RDWR)) < 0){
+      printf("%s: create %s failed\n", s, name);
+      exit(1);
+    }
+    close(fd);
+  }
+  for(i = 0; i < N; i++){
+    name[3] = 'a' + i / 100;
+    name[4] = '0' + (i / 10) % 10;
+    name[5] = '0' + i % 10;
+    if((fd = open(name, O_RDONLY)) < 0){
+      printf("%s: open %s failed\n", s, name);
+      exit(1);
+    }
+    close(fd);
+  }
+
+  if((fd = open("dx", O_RDONLY)) < 0){
+    printf("%s: open dx failed\n", s);
+    exit(1);
+  }
+  n = 0;
+  while(read(fd, &de, sizeof(de)) == sizeof(de)){
+    if(de.inum != 0)
+      n++;
+  }
+  close(fd);
+  if(n != N + 2){
+    printf("%s: read %d entries, expected %d\n", s, n, N + 2);
+    exit(1);
+  }
+
+  if(unlink("dx") == 0){
+    printf("%s: unlinked non-empty dx\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    name[3] = 'a' + i / 100;
+    name[4] = '0' + (i / 10) % 10;
+    name[5] = '0' + i % 10;
+    if(unlink(name) != 0){
+      printf("%s: unlink %s failed\n", s, name);
+      exit(1);
+    }
+  }
+  if(unlink("dx") != 0){
+    printf("%s: unlink empty dx failed\n", s);
+    exit(1);
+  }
+}
+
+// names that all hash to one bucket split it all the way to
+// DIRDEPTH and then chain, in one create()'s transaction;
+// every create must still succeed.
+void
+dircollide(char *s)
+{
+  enum { N = 100 };
+  char names[N][DIRSIZ], path[3 + DIRSIZ];
+  int i, j, k, n, fd;
+
+  for(i = 0, j = 0; i < N; j++){
+    names[i][0] = 'c';
+    for(k = 1, n = j; k < 5; k++, n /= 26)
+      names[i][k] = 'a' + n % 26;
+    names[i][5] = '\0';
+    if((dirhash(names[i]) & ((1 << DIRDEPTH) - 1)) == 0)
+      i++;
+  }
+
+  if(mkdir("dc") != 0){
+    printf("%s: mkdir dc failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    strcpy(path, "dc/");
+    strcpy(path + 3, names[i]);
+    if((fd = open(path, O_CREATE|O_RDWR)) < 0){
+      printf("%s: create %s failed\n", s, path);
+      exit(1);
+    }
+    close(fd);
+  }
+  for(i = 0; i < N; i++){
+    strcpy(path, "dc/");
+    strcpy(path + 3, names[i]);
+    if(unlink(path) != 0){
+      printf("%s: unlink %s failed\n", s, path);
+      exit(1);
+    }
+  }
+  if(unlink("dc") != 0){
+    printf("%s: unlink dc failed\n", s);
+    exit(1);
+  }
+}
+
 void
 subdir(char *s)
 {
@@ -2040,6 +2923,71 @@ iref(char *s)
   chdir("/");
 }
 
+// hold more inodes open at once, across several processes,
+// than the old fixed-size inode table had entries.
+void
+manyinodes(char *s)
+{
+  enum { NCHILD = 7, NOPEN = 10 };
+  int ready[2], done[2], c, i, fd, pid, xstatus;
+  char name[5], x;
+
+  if(pipe(ready) < 0 || pipe(done) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  name[0] = 'm';
+  name[1] = 'i';
+  name[4] = '\0';
+  for(c = 0; c < NCHILD; c++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      close(ready[0]);
+      close(done[1]);
+      name[2] = '0' + c;
+      for(i = 0; i < NOPEN; i++){
+        name[3] = '0' + i;
+        if((fd = open(name, O_CREATE|O_RDWR)) < 0){
+          printf("%s: create %s failed\n", s, name);
+          exit(1);
+        }
+      }
+      write(ready[1], "x", 1);
+      read(done[0], &x, 1);  // hold the files until the parent is done
+      exit(0);
+    }
+  }
+  close(ready[1]);
+  close(done[0]);
+  for(c = 0; c < NCHILD; c++){
+    if(read(ready[0], &x, 1) != 1){
+      printf("%s: child failed\n", s);
+      exit(1);
+    }
+  }
+  close(done[1]);
+  close(ready[0]);
+  for(c = 0; c < NCHILD; c++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(1);
+  }
+  for(c = 0; c < NCHILD; c++){
+    name[2] = '0' + c;
+    for(i = 0; i < NOPEN; i++){
+      name[3] = '0' + i;
+      if(unlink(name) != 0){
+        printf("%s: unlink %s failed\n", s, name);
+        exit(1);
+      }
+    }
+  }
+}
+
 // test that fork fails gracefully
 // the forktest binary also does this, but it runs out of proc entries first.
 // inside the bigger usertests binary, we run out of memory first.
@@ -2080,6 +3028,54 @@ forktest(char *s)
   }
 }
 
+// fork a process that uses more than half of physical memory.
+// only a copy-on-write fork can succeed, and the parent and
+// child must still see separate copies once they write.
+void
+cowfork(char *s)
+{
+  int sz = (PHYSTOP - KERNBASE) / 3 * 2;
+  int pid, xstatus, ppid = getpid();
+  char *p, *q;
+
+  p = sbrk(sz);
+  if(p == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk(%d) failed\n", s, sz);
+    exit(1);
+  }
+  for(q = p; q < p + sz; q += PGSIZE)
+    *(int*)q = ppid;
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(q = p; q < p + sz; q += PGSIZE){
+      if(*(int*)q != ppid){
+        printf("%s: child sees wrong data\n", s);
+        exit(1);
+      }
+    }
+    // a few private copies fit easily.
+    for(q = p; q < p + 16*PGSIZE; q += PGSIZE)
+      *(int*)q = getpid();
+    exit(0);
+  }
+
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(xstatus);
+  for(q = p; q < p + sz; q += PGSIZE){
+    if(*(int*)q != ppid){
+      printf("%s: child's write visible in parent\n", s);
+      exit(1);
+    }
+  }
+  sbrk(-sz);
+}
+
 void
 sbrkbasic(char *s)
 {
@@ -2204,6 +3200,71 @@ sbrkmuch(char *s)
   }
 }
 
+// sbrk() of more memory than the machine has should
+// succeed, since pages are only allocated when touched,
+// and system calls must be able to use untouched pages.
+void
+lazysbrk(char *s)
+{
+  enum { BIG=1024*1024*1024 };
+  int fds[2], pid, xstatus, i;
+  char *a, *p;
+
+  a = sbrk(BIG);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk(BIG) failed\n", s);
+    exit(1);
+  }
+  for(p = a; p < a + BIG; p += BIG/16){
+    if(*p != 0){
+      printf("%s: new page not zero\n", s);
+      exit(1);
+    }
+    *p = 1;
+  }
+
+  // copyin from and copyout to pages never touched.
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  if(write(fds[1], a + BIG/32, PGSIZE) != PGSIZE){
+    printf("%s: write from untouched page failed\n", s);
+    exit(1);
+  }
+  p = a + 3*(BIG/32);
+  if(read(fds[0], p, PGSIZE) != PGSIZE){
+    printf("%s: read into untouched page failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < PGSIZE; i++){
+    if(p[i] != 0){
+      printf("%s: read wrong data\n", s);
+      exit(1);
+    }
+  }
+  close(fds[0]);
+  close(fds[1]);
+
+  // fork() must cope with the holes.
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(a[BIG/16] != 1 || a[5*(BIG/32)] != 0)
+      exit(1);
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child saw wrong heap\n", s);
+    exit(1);
+  }
+  sbrk(-BIG);
+}
+
 // can we read the kernel's memory?
 void
 kernmem(char *s)
@@ -2855,6 +3916,7 @@ main(int argc, char *argv[])
     {bsstest, "bsstest"},
     {sbrkbasic, "sbrkbasic"},
     {sbrkmuch, "sbrkmuch"},
+    {lazysbrk, "lazysbrk"},
     {kernmem, "kernmem"},
     {sbrkfail, "sbrkfail"},
     {sbrkarg, "sbrkarg"},
@@ -2871,15 +3933,33 @@ main(int argc, char *argv[])
     {iputtest, "iput"},
     {mem, "mem"},
     {pipe1, "pipe1"},
+    {pipesize, "pipesize"},
+    {splicetest, "splicetest"},
+    {teecross, "teecross"},
+    {mmaptest, "mmaptest"},
+    {mmapshared, "mmapshared"},
+    {munmapfront, "munmapfront"},
+    {textwrite, "textwrite"},
+    {exectext, "exectext"},
+    {pcachetest, "pcachetest"},
     {killstatus, "killstatus"},
     {preempt, "preempt"},
+    {killsleep, "killsleep"},
+    {threads, "threads"},
+    {threadlock, "threadlock"},
+    {threadmmap, "threadmmap"},
+    {futexfork, "futexfork"},
     {exitwait, "exitwait"},
     {rmdot, "rmdot"},
     {fourteen, "fourteen"},
     {bigfile, "bigfile"},
     {dirfile, "dirfile"},
     {iref, "iref"},
+    {manyinodes, "manyinodes"},
     {forktest, "forktest"},
+    {cowfork, "cowfork"},
+    {dirindex, "dirindex"},
+    {dircollide, "dircollide"},
     {bigdir, "bigdir"}, // slow
     { 0, 0},
   };
@@ -36,3 +36,12 @@ entry("getpid");
 entry("sbrk");
 entry("sleep");
 entry("uptime");
+entry("setpriority");
+entry("clone");
+entry("join");
+entry("futex");
+entry("fcntl");
+entry("splice");
+entry("tee");
+entry("mmap");
+entry("munmap");